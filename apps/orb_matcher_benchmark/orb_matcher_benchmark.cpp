@@ -0,0 +1,91 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+// Time the Hamming distance kernels of ORB descriptors (XP/util/orb_matcher.h) of every
+// instruction set supported by this CPU, and check that they match the scalar kernel exactly.
+#include <gflags/gflags.h>
+#include <XP/util/orb_matcher.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+DEFINE_int32(num_query, 200, "Query descriptors, e.g., the ORB features of the left image");
+DEFINE_int32(num_train, 203, "Train descriptors.  Not a multiple of 4 to check the tails");
+DEFINE_int32(iterations, 100, "How many times to match all the query descriptors per kernel");
+
+using XPDRIVER::SimdIsa;
+
+// Return the microseconds per iteration.  dists: num_query x num_train on return.
+float compute_dists(XP::HammingDistsFunc dists_func, const std::vector<uint8_t>& query,
+                    const std::vector<uint8_t>& train, std::vector<int>* dists) {
+  dists->resize(FLAGS_num_query * FLAGS_num_train);
+  const auto start = std::chrono::steady_clock::now();
+  for (int it = 0; it < FLAGS_iterations; ++it) {
+    for (int q = 0; q < FLAGS_num_query; ++q) {
+      dists_func(query.data() + q * XP::kOrbDescBytes, train.data(), FLAGS_num_train,
+                 dists->data() + q * FLAGS_num_train);
+    }
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count() / static_cast<float>(FLAGS_iterations);
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  std::vector<uint8_t> query(FLAGS_num_query * XP::kOrbDescBytes);
+  std::vector<uint8_t> train(FLAGS_num_train * XP::kOrbDescBytes);
+  std::mt19937 rng(0);
+  for (uint8_t& b : query) {
+    b = static_cast<uint8_t>(rng());
+  }
+  for (uint8_t& b : train) {
+    b = static_cast<uint8_t>(rng());
+  }
+  // The extreme distances 0 and 256, i.e., the max byte counts of the SIMD sums
+  if (FLAGS_num_query > 0 && FLAGS_num_train > 1) {
+    std::copy(query.begin(), query.begin() + XP::kOrbDescBytes, train.begin());
+    for (int i = 0; i < XP::kOrbDescBytes; ++i) {
+      train[XP::kOrbDescBytes + i] = ~query[i];
+    }
+  }
+
+  std::vector<SimdIsa> isas = {SimdIsa::SCALAR};
+  const SimdIsa best_isa = XPDRIVER::detect_simd_isa();
+  if (best_isa == SimdIsa::AVX2) {
+    isas.push_back(SimdIsa::SSE4_1);
+  }
+  if (best_isa != SimdIsa::SCALAR) {
+    isas.push_back(best_isa);
+  }
+
+  std::vector<int> ref_dists;
+  compute_dists(XP::hamming_dists_scalar, query, train, &ref_dists);
+
+  std::cout << FLAGS_num_query << " x " << FLAGS_num_train << " descriptors, "
+            << FLAGS_iterations << " iterations (us per iteration)\n";
+  bool all_exact = true;
+  for (SimdIsa isa : isas) {
+    std::vector<int> dists;
+    const float us = compute_dists(XP::select_hamming_dists(isa), query, train, &dists);
+    const bool exact = dists == ref_dists;
+    all_exact = all_exact && exact;
+    std::cout << std::setw(8) << XPDRIVER::SimdIsaName[static_cast<int>(isa)]
+              << " " << std::setw(8) << us
+              << (exact ? "" : "  MISMATCH with scalar") << "\n";
+  }
+  return all_exact ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+// Time the weighted patch SSD kernels (XP/util/patch_match_kernels.h) of every instruction set
+// supported by this CPU on scanline searches, and check that they match the scalar kernel
+// bit by bit, for every block size.
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <XP/util/patch_match_kernels.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+DEFINE_string(img_l, "", "Left image of a rectified stereo pair.  Random images if empty");
+DEFINE_string(img_r, "", "Right image of a rectified stereo pair");
+DEFINE_int32(width, 752, "Width of the random images");
+DEFINE_int32(height, 480, "Height of the random images");
+DEFINE_int32(grid, 8, "Search the master patches at every grid pixels of the left image");
+DEFINE_int32(max_disparity, 64, "Search range on the scanline of the right image");
+
+using XPDRIVER::SimdIsa;
+
+// Gaussian weights of a block, row by row, quantized once per block size
+std::vector<int16_t> make_weights(int block_size) {
+  std::vector<float> weights(block_size * block_size);
+  const float sigma = block_size / 3.f;
+  const float center = (block_size - 1) * 0.5f;
+  for (int y = 0; y < block_size; ++y) {
+    for (int x = 0; x < block_size; ++x) {
+      const float r2 = (x - center) * (x - center) + (y - center) * (y - center);
+      weights[y * block_size + x] = std::exp(-r2 / (2.f * sigma * sigma));
+    }
+  }
+  std::vector<int16_t> weights_q;
+  XP::quantize_patch_weights(weights.data(), block_size, &weights_q);
+  return weights_q;
+}
+
+// Search every master patch of the grid on its scanline of img_r, like the rectified stereo
+// matching of the slave image.  Append the costs of every position to costs, and return the
+// microseconds.
+float search_patches(XP::PatchSsdFunc ssd_func, const cv::Mat& img_l, const cv::Mat& img_r,
+                     int block_size, const std::vector<int16_t>& weights,
+                     std::vector<int>* costs) {
+  std::vector<int16_t> master_patch;
+  std::vector<int> patch_costs;
+  XP::PatchSearchResult result;
+  costs->clear();
+  const auto start = std::chrono::steady_clock::now();
+  for (int y = 0; y + block_size <= img_l.rows; y += FLAGS_grid) {
+    for (int x = 0; x + block_size <= img_l.cols; x += FLAGS_grid) {
+      XP::load_patch(img_l, x, y, block_size, &master_patch);
+      if (XP::search_patch_on_scanline(ssd_func, master_patch, weights, block_size, img_r, y,
+                                       std::max(x - FLAGS_max_disparity, 0), x + 1,
+                                       &patch_costs, &result)) {
+        costs->insert(costs->end(), patch_costs.begin(), patch_costs.end());
+      }
+    }
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  cv::Mat img_l, img_r;
+  if (FLAGS_img_l.empty()) {
+    img_l.create(FLAGS_height, FLAGS_width, CV_8U);
+    img_r.create(FLAGS_height, FLAGS_width, CV_8U);
+    std::mt19937 rng(0);
+    for (int y = 0; y < FLAGS_height; ++y) {
+      for (int x = 0; x < FLAGS_width; ++x) {
+        img_l.at<uint8_t>(y, x) = static_cast<uint8_t>(rng());
+        img_r.at<uint8_t>(y, x) = static_cast<uint8_t>(rng());
+      }
+    }
+  } else {
+    img_l = cv::imread(FLAGS_img_l, cv::IMREAD_GRAYSCALE);
+    img_r = cv::imread(FLAGS_img_r, cv::IMREAD_GRAYSCALE);
+    CHECK(!img_l.empty()) << "Cannot read " << FLAGS_img_l;
+    CHECK(!img_r.empty()) << "Cannot read " << FLAGS_img_r;
+    CHECK_EQ(img_l.size(), img_r.size());
+  }
+
+  std::vector<SimdIsa> isas = {SimdIsa::SCALAR};
+  const SimdIsa best_isa = XPDRIVER::detect_simd_isa();
+  if (best_isa == SimdIsa::AVX2) {
+    isas.push_back(SimdIsa::SSE4_1);
+  }
+  if (best_isa != SimdIsa::SCALAR) {
+    isas.push_back(best_isa);
+  }
+
+  const std::vector<int> block_sizes = {4, 8, 12, XP::kMaxPatchBlockSize};
+  std::vector<std::vector<int16_t>> weights;
+  std::vector<std::vector<int>> ref_costs(block_sizes.size());
+  for (size_t i = 0; i < block_sizes.size(); ++i) {
+    weights.push_back(make_weights(block_sizes[i]));
+    search_patches(XP::patch_ssd_scalar, img_l, img_r, block_sizes[i], weights[i],
+                   &ref_costs[i]);
+  }
+
+  std::cout << img_l.cols << "x" << img_l.rows << " grid " << FLAGS_grid << ", "
+            << FLAGS_max_disparity << " disparities (us per image, by block size)\n";
+  bool all_exact = true;
+  for (SimdIsa isa : isas) {
+    const XP::PatchSsdFunc ssd_func = XP::select_patch_ssd(isa);
+    std::cout << std::setw(8) << XPDRIVER::SimdIsaName[static_cast<int>(isa)];
+    bool exact = true;
+    for (size_t i = 0; i < block_sizes.size(); ++i) {
+      std::vector<int> costs;
+      const float us = search_patches(ssd_func, img_l, img_r, block_sizes[i], weights[i],
+                                      &costs);
+      exact = exact && costs == ref_costs[i];
+      std::cout << " " << std::setw(2) << block_sizes[i] << ": " << std::setw(8) << us;
+    }
+    all_exact = all_exact && exact;
+    std::cout << (exact ? "" : "  MISMATCH with scalar") << "\n";
+  }
+  return all_exact ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+// Time the pyramid downsampling kernels (XP/util/pyramid_kernels.h) of every instruction set
+// supported by this CPU, and check that they match the scalar kernels bit by bit.
+#include <gflags/gflags.h>
+#include <XP/util/pyramid_kernels.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+DEFINE_int32(width, 752, "Width of the level 0 image");
+DEFINE_int32(height, 480, "Height of the level 0 image");
+DEFINE_int32(levels, 4, "Pyramid levels to build, including level 0");
+DEFINE_int32(iterations, 1000, "How many pyramids to build per kernel");
+
+using XPDRIVER::SimdIsa;
+
+struct Image {
+  int rows;
+  int cols;
+  std::vector<uint8_t> data;
+  Image(int rows_in, int cols_in) : rows(rows_in), cols(cols_in), data(rows_in * cols_in) {}
+  uint8_t* row(int r) { return data.data() + r * cols; }
+};
+
+// Same loop as fast_pyra_down_original / fast_mask_pyra_down
+void pyra_down(XP::PyraDownRowFunc row_func, Image& in, Image* out) {
+  for (int y = 0; y < out->rows; ++y) {
+    row_func(in.row(2 * y), in.row(2 * y + 1), out->row(y), out->cols);
+  }
+}
+
+// Return the microseconds per pyramid
+float build_pyramids(XP::PyraDownRowFunc row_func, std::vector<Image>* pyramid) {
+  const auto start = std::chrono::steady_clock::now();
+  for (int it = 0; it < FLAGS_iterations; ++it) {
+    for (size_t l = 1; l < pyramid->size(); ++l) {
+      pyra_down(row_func, (*pyramid)[l - 1], &(*pyramid)[l]);
+    }
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count() / static_cast<float>(FLAGS_iterations);
+}
+
+std::vector<Image> make_pyramid(const Image& level0) {
+  std::vector<Image> pyramid(1, level0);
+  for (int l = 1; l < FLAGS_levels; ++l) {
+    pyramid.push_back(Image(pyramid.back().rows / 2, pyramid.back().cols / 2));
+  }
+  return pyramid;
+}
+
+bool same_pyramids(const std::vector<Image>& a, const std::vector<Image>& b) {
+  for (size_t l = 0; l < a.size(); ++l) {
+    if (a[l].data != b[l].data) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  // Try an odd --width to also check the scalar tails of the SIMD kernels
+  Image image(FLAGS_height, FLAGS_width);
+  Image mask(FLAGS_height, FLAGS_width);
+  std::mt19937 rng(0);
+  for (size_t i = 0; i < image.data.size(); ++i) {
+    image.data[i] = static_cast<uint8_t>(rng());
+    // Sparse 0x00 holes, like a camera mask with a few bad pixels
+    mask.data[i] = (rng() % 64 == 0) ? 0x00 : 0xff;
+  }
+
+  std::vector<SimdIsa> isas = {SimdIsa::SCALAR};
+  const SimdIsa best_isa = XPDRIVER::detect_simd_isa();
+  if (best_isa == SimdIsa::AVX2) {
+    isas.push_back(SimdIsa::SSE4_1);
+  }
+  if (best_isa != SimdIsa::SCALAR) {
+    isas.push_back(best_isa);
+  }
+
+  std::vector<Image> ref_image_pyramid = make_pyramid(image);
+  std::vector<Image> ref_mask_pyramid = make_pyramid(mask);
+  const XP::PyraDownKernels scalar = XP::select_pyra_down_kernels(SimdIsa::SCALAR);
+  build_pyramids(scalar.pyra_down_row, &ref_image_pyramid);
+  build_pyramids(scalar.mask_pyra_down_row, &ref_mask_pyramid);
+
+  std::cout << FLAGS_width << "x" << FLAGS_height << " " << FLAGS_levels << " levels, "
+            << FLAGS_iterations << " iterations (us per pyramid)\n";
+  bool all_exact = true;
+  for (SimdIsa isa : isas) {
+    const XP::PyraDownKernels kernels = XP::select_pyra_down_kernels(isa);
+    std::vector<Image> image_pyramid = make_pyramid(image);
+    std::vector<Image> mask_pyramid = make_pyramid(mask);
+    const float image_us = build_pyramids(kernels.pyra_down_row, &image_pyramid);
+    const float mask_us = build_pyramids(kernels.mask_pyra_down_row, &mask_pyramid);
+    const bool exact = same_pyramids(image_pyramid, ref_image_pyramid) &&
+        same_pyramids(mask_pyramid, ref_mask_pyramid);
+    all_exact = all_exact && exact;
+    std::cout << std::setw(8) << XPDRIVER::SimdIsaName[static_cast<int>(isa)]
+              << " image " << std::setw(8) << image_us
+              << " mask " << std::setw(8) << mask_us
+              << (exact ? "" : "  MISMATCH with scalar") << "\n";
+  }
+  return all_exact ? 0 : 1;
+}
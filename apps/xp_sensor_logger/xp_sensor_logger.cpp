@@ -17,15 +17,23 @@
 #define _GNU_SOURCE
 #endif
 #include <glog/logging.h>
+#include <XP/helper/dataset_file.h>
+#include <XP/helper/image_writer_pool.h>
+#include <XP/helper/imu_log_file.h>
 #include <XP/helper/shared_queue.h>
+#include <XP/helper/spsc_queue.h>
 #include <XP/helper/timer.h>
 #include <XP/helper/param.h>
 #include <XP/helper/tag_detector.h>
 #include <driver/XP_sensor_driver.h>
+#include <driver/helper/image_buffer_pool.h>
 #include <XP/util/calibration_utils.h>
 #include <XP/depth/depth_utils.h>
+#include <XP/depth/disparity_reproject.h>
 #include <XP/util/feature_utils.h>
 #include <XP/util/image_utils.h>
+#include <XP/util/orb_matcher.h>
+#include <XP/util/pyramid_set.h>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #ifdef HAS_OPENCV_VIZ  // defined in CMakeLists
@@ -62,15 +70,30 @@ DEFINE_string(depth_param_yaml, "", "load depth config file");
 DEFINE_bool(depth, false, "whether or not show depth image");
 DEFINE_bool(ir_depth, false, "whether or not show ir depth image");
 DEFINE_string(dev_name, "", "which dev to open. Empty enables auto mode");
+DEFINE_bool(half_res, false, "2x2-bin the images from the driver (and use half-scale calib)");
 DEFINE_bool(headless, false, "Do not show windows");
 DEFINE_bool(horizontal_line, false, "show green horizontal lines for disparity check");
 DEFINE_bool(imu_from_image, false, "Load imu from image. Helpful for USB2.0");
+DEFINE_string(imu_format, "text", "text: record_path/imu_data.txt. binary: record_path/"
+              "imu_data.bin, written in blocks and synced every second. The imu samples "
+              "wait in a 16384-sample (~16 sec at 1 kHz) queue, and are dropped with an error "
+              "if the imu writer stalls longer than that");
+DEFINE_string(imu_log_to_text, "", "Convert this imu_data.bin to imu_data.txt in the same "
+              "folder, and exit");
 DEFINE_bool(orb_verify, false, "Use ORB feature matching to verify calib result");
 DEFINE_bool(save_image_bin, false, "Do not save image bin file");
+DEFINE_int32(save_workers, 2, "The threads encoding the png files of record_path");
+DEFINE_string(save_overflow, "spill", "If the png encoders fall behind, drop the new images, "
+              "block (the image queues back up to the driver), or spill them to "
+              "record_path/spill.raw, which is read back in order once the encoders catch up. "
+              "With block or spill, the logger saves every frame, also the queued ones at exit");
 DEFINE_string(sensor_type, "", "XP or XP2 or XP3 or FACE or XPIRL or XPIRL2, XPIRL3, XPIRL3_A");
 DEFINE_bool(show_hist, false, "Show image histogram (left and right)");
 DEFINE_bool(spacebar_mode, false, "only save img when press space bar");
 DEFINE_string(record_path, "", "path to save images. Set empty to disable saving");
+DEFINE_string(record_format, "png", "png: one png file per image and imu_data.txt. "
+              "dataset_raw / dataset_png: one chunked, mmap-able dataset.xpds file "
+              "with raw / png-compressed images");
 DEFINE_double(valid_ratio, 0.95,
               "The valid ratio (diagonal direction) to check the point coverage from the image "
               "center. Suggested value: 0.95 for 120 deg FOV and 0.55 for 170 deg FOV.");
@@ -95,8 +118,9 @@ struct V4l2BufferData {
 struct ImgForSave {
   cv::Mat l;
   cv::Mat r;
-  cv::Mat xyz;
+  cv::Mat z_mm;  // Z in mm (CV_16UC1)
   std::string name;
+  float ts_100us;
 };
 struct StereoImage {
   cv::Mat l;
@@ -108,21 +132,42 @@ struct ImgForShow {
   std::string image_name;
   std::mutex image_show_mutex;
 };
-XP::shared_queue<XPDRIVER::ImuData> imu_data_queue("imu_data_queue");
+// Pushed by the driver imu thread only and popped by thread_write_imu_data only.
+// 16384 samples is ~16 sec of 1 kHz imu, i.e., the longest imu writer stall tolerated.
+// Samples pushed to a full queue are dropped (see imu_format).
+XP::spsc_queue<XPDRIVER::ImuData> imu_data_queue("imu_data_queue", 16384);
+// Counted by the driver imu thread, and logged by thread_write_imu_data
+std::atomic<uint64_t> g_imu_dropped(0);
 XP::shared_queue<ImgForSave> imgs_for_saving_queue("imgs_for_saving_queue");
 XP::shared_queue<ImgForSave> IR_imgs_for_saving_queue("IR_imgs_for_saving_queue");
 XP::shared_queue<StereoImage> IR_depth_queue("IR_depth_queue");
-XP::shared_queue<StereoImage> stereo_image_queue("stereo_image_queue");
-XP::shared_queue<StereoImage> IR_image_queue("IR_image_queue");
+// The image processing threads only keep up with the latest images if they fall kMaxQueuedImages
+// frames behind, unless g_save_all_frames (see main)
+constexpr size_t kMaxQueuedImages = 10;
+XP::shared_queue<StereoImage> stereo_image_queue("stereo_image_queue", kMaxQueuedImages,
+                                                 XP::OverflowPolicy::KEEP_LATEST);
+XP::shared_queue<StereoImage> IR_image_queue("IR_image_queue", kMaxQueuedImages,
+                                             XP::OverflowPolicy::KEEP_LATEST);
 std::atomic<bool> run_flag;
 std::atomic<bool> save_img, save_ir_img;
 SensorType XP_sensor_type;
+// Only set if record_format is dataset_*.  Shared by the save threads (it is thread-safe).
+std::unique_ptr<XP::DatasetWriter> g_dataset_writer;
+// Only set if record_path is set (the png images, or the Z images of the dataset_* formats).
+// Shared by the save threads.
+std::unique_ptr<XP::ImageWriterPool> g_image_writer_pool;
+// The frames being encoded or written before save_overflow kicks in
+constexpr size_t kMaxPendingSaves = 16;
+// Record every frame, i.e., record_path is set without spacebar_mode, and save_overflow is not
+// drop.  Then the image queues block their producers instead of dropping, the image threads
+// only save the frames they fall behind on, and the queues are drained at exit.  Set in main.
+bool g_save_all_frames = false;
 // we use the first imu to approx img time based on img counter
 cv::Size g_img_size;
 // The unique instance of XpSensorMultithread
 std::unique_ptr<XPDRIVER::XpSensorMultithread> g_xp_sensor_ptr;
 XP::AprilTagDetector g_ap_detector;
-cv::BFMatcher g_orb_matcher(cv::NORM_HAMMING);
+XP::OrbMatcher g_orb_matcher;
 ImgForShow g_img_lr_display, g_img_lr_IR_display;
 ImgForShow g_depth_canvas;
 ImgForShow g_hist_canvas;
@@ -131,6 +176,31 @@ vector<ImgForShow> g_visualize_img_lr(2);
 bool g_has_IR;
 bool g_calib_loaded = false;
 XP::DuoCalibParam g_calib_param;
+// half_res: replace the images with the truncated average of every 2x2 block, i.e., the same
+// as fast_pyra_down_original, in buffers of ImageBufferPool.
+// [NOTE] Call it from the image threads, not from the driver callbacks.
+void maybe_bin_2x2(StereoImage* stereo_img) {
+  if (!FLAGS_half_res) {
+    return;
+  }
+  cv::Mat* imgs[2] = {&stereo_img->l, &stereo_img->r};
+  for (cv::Mat* img : imgs) {
+    if (img->empty()) {
+      continue;
+    }
+    cv::Mat binned;
+    XPDRIVER::ImageBufferPool::getInstance().create(img->rows / 2, img->cols / 2, img->type(),
+                                                    &binned);
+    if (img->type() == CV_8U) {
+      XP::pyra_down_to(XP::pyra_down_kernels().pyra_down_row, *img, &binned);
+    } else {
+      // Color images
+      cv::resize(*img, binned, binned.size(), 0, 0, cv::INTER_AREA);
+    }
+    *img = binned;
+  }
+}
+
 // Callback functions for XpSensorMultithread
 // [NOTE] These callback functions have to be light-weight as it *WILL* block XpSensorMultithread
 void image_data_callback(const cv::Mat& img_l, const cv::Mat& img_r, const float ts_100us,
@@ -161,7 +231,10 @@ void IR_data_callback(const cv::Mat& img_l, const cv::Mat& img_r, const float ts
 
 void imu_data_callback(const XPDRIVER::ImuData& imu_data) {
   if (run_flag) {
-    imu_data_queue.push_back(imu_data);
+    if (!imu_data_queue.push_back(imu_data)) {
+      // [NOTE] Do not log here.  A full queue means the writer stalls already.
+      g_imu_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
   }
 }
 
@@ -176,7 +249,8 @@ void image_thread_safe_show(ImgForShow* image_show) {
 }
 
 // Utility functions
-void verify_calibration(const vector<cv::Mat_<uchar>>& cam_mask_lr,
+// pyramid_set_pool: only used by orb_verify
+void verify_calibration(XP::PyramidSetPool* pyramid_set_pool,
                         const vector<cv::Matx34f>& proj_mat_lr,
                         const XP::DuoCalibParam& calib_param,
                         const cv::Mat& img_l_mono,
@@ -230,36 +304,28 @@ void verify_calibration(const vector<cv::Mat_<uchar>>& cam_mask_lr,
     vector<cv::Mat> orb_lr(2);
     const int request_feat_num = 200;
     const int fast_thresh = 15;
-    XP::detect_orb_features(img_l_mono,
-                            cam_mask_lr[0],
-                            request_feat_num,
-                            2,  // pyra_level,
-                            fast_thresh,
-                            true,  // use_fast (or TomasShi)
-                            5,  // enforce_uniformatiy_radius (less than 5 means no enforcement)
-                            &kp_lr[0],
-                            &orb_lr[0]);
+    CHECK_NOTNULL(pyramid_set_pool);
+    // 2 pyramid levels and detect on the top one, as the raw-image detect_orb_features
+    const std::shared_ptr<const XP::PyramidSet> pyramids =
+        pyramid_set_pool->build(img_l_mono, img_r_mono);
+    for (int lr = 0; lr < 2; ++lr) {
+      XP::detect_orb_features(*pyramids,
+                              lr,
+                              request_feat_num,
+                              1,  // det_pyra_level
+                              fast_thresh,
+                              true,  // use_fast (or TomasShi)
+                              5,  // enforce_uniformatiy_radius (less than 5 means no enforcement)
+                              &kp_lr[lr],
+                              &orb_lr[lr]);
+    }
     det_count_l = kp_lr[0].size();
-    XP::detect_orb_features(img_r_mono,
-                            cam_mask_lr[1],
-                            request_feat_num,
-                            2,  // pyra_level,
-                            fast_thresh,
-                            true,  // use_fast ( or TomasShi)
-                            5,  // enforce_uniformatiy_radius (less than 5 means no enforcement)
-                            &kp_lr[1],
-                            &orb_lr[1]);
     det_count_r = kp_lr[1].size();
     if (!kp_lr[0].empty() && !kp_lr[1].empty()) {
       // matching
-      vector<vector<vector<cv::DMatch>>> matches_lr(2);
-      vector<cv::Mat> matching_mask_lr(2);
-      matching_mask_lr[0].create(orb_lr[0].rows, orb_lr[1].rows, CV_8U);
-      matching_mask_lr[0].setTo(0x01);
-      matching_mask_lr[1].create(orb_lr[1].rows, orb_lr[0].rows, CV_8U);
-      matching_mask_lr[1].setTo(0x01);
-      g_orb_matcher.knnMatch(orb_lr[0], orb_lr[1], matches_lr[0], 1, matching_mask_lr[0]);
-      g_orb_matcher.knnMatch(orb_lr[1], orb_lr[0], matches_lr[1], 1, matching_mask_lr[1]);
+      vector<vector<cv::DMatch>> matches_lr(2);
+      g_orb_matcher.match(orb_lr[0], orb_lr[1], &matches_lr[0]);
+      g_orb_matcher.match(orb_lr[1], orb_lr[0], &matches_lr[1]);
       // cross validation
       vector<vector<bool>> is_matched_lr(2);
       for (int  lr = 0; lr < 2; ++lr) {
@@ -270,8 +336,8 @@ void verify_calibration(const vector<cv::Mat_<uchar>>& cam_mask_lr,
         }
       }
       for (int it_pnt_0 = 0; it_pnt_0 < orb_lr[0].rows; ++it_pnt_0) {
-        const int match_id_in_1 = matches_lr[0][it_pnt_0][0].trainIdx;
-        const int match_id_in_0 = matches_lr[1][match_id_in_1][0].trainIdx;
+        const int match_id_in_1 = matches_lr[0][it_pnt_0].trainIdx;
+        const int match_id_in_0 = matches_lr[1][match_id_in_1].trainIdx;
         if (match_id_in_0 == it_pnt_0) {
           kp_lr[0][it_pnt_0].class_id = match_id_in_1;
           kp_lr[1][match_id_in_1].class_id = it_pnt_0;
@@ -375,6 +441,7 @@ void verify_calibration(const vector<cv::Mat_<uchar>>& cam_mask_lr,
 }
 
 cv::Mat_<cv::Vec3f> g_depth_xyz_img;
+cv::Mat g_depth_z_mm_img;
 cv::Mat g_disparity_img;
 cv::Mat g_disparity_buf;  // for filterSpeckles
 vector<cv::Mat> g_disparity_ml;
@@ -397,36 +464,18 @@ void visualize_depth(const XP::DuoCalibParam& calib_param,
       || (FLAGS_viz3d && !FLAGS_headless)
 #endif
       ) {
-    if (g_depth_xyz_img.rows == 0) {
-      g_depth_xyz_img.create(g_disparity_img.rows, g_disparity_img.cols);
-    }
-    g_depth_xyz_img.setTo(cv::Vec3f(0, 0, 0));
-    for (int y = 0; y < g_disparity_img.rows; ++y) {
-      for (int x = 0; x < g_disparity_img.cols; ++x) {
-        int16_t disp = g_disparity_img.at<int16_t>(y, x);
-        if (disp <= 0) continue;
-        // http://docs.opencv.org/3.0.0/d9/d0c/group__calib3d.html#ga1bc1152bd57d63bc524204f21fde6e02
-        // [XYZW]T=𝚀∗[x y 𝚍𝚒𝚜𝚙𝚊𝚛𝚒𝚝𝚢(x,y) 1]T
-        cv::Vec4f xyz_homo;
-        if (FLAGS_depth)
-          xyz_homo = calib_param.Camera.Q *
-                     cv::Vec4f(x, y, static_cast<float>(disp) / 16.f, 1);
-        cv::Vec3f xyz_C(xyz_homo[0] / xyz_homo[3],
-                        xyz_homo[1] / xyz_homo[3],
-                        xyz_homo[2] / xyz_homo[3]);
-        g_depth_xyz_img.at<cv::Vec3f>(y, x) = xyz_C;
-      }
+    // xyz is only needed by the point cloud, and Z in mm for saving
+    cv::Mat* xyz_img = nullptr;
+#ifdef HAS_OPENCV_VIZ
+    if (FLAGS_viz3d && !FLAGS_headless) {
+      xyz_img = &g_depth_xyz_img;
     }
+#endif
+    XP::disparity_to_xyz(g_disparity_img, calib_param.Camera.Q, xyz_img,
+                         save_img ? &g_depth_z_mm_img : nullptr);
   }
   if (!FLAGS_headless) {
-    if (depth_canvas->size() != g_disparity_img.size()) {
-      depth_canvas->create(g_disparity_img.size(), CV_8UC3);
-    }
-    for (int i = 0; i < g_disparity_img.rows; ++i) {
-      for (int j = 0; j < g_disparity_img.cols; ++j) {
-        depth_canvas->at<cv::Vec3b>(i, j) = XP::depth16S2color(g_disparity_img.at<int16_t>(i, j));
-      }
-    }
+    XP::colorize_disparity(g_disparity_img, depth_canvas);
 
 #ifdef HAS_OPENCV_VIZ
     // compute xyz
@@ -536,6 +585,20 @@ void process_stereo_ir_depth(const XP::DuoCalibParam& rgb_calib_param,
 #endif
 }
 
+// Log the stats of queue if it has dropped elements since the last call.
+// Otherwise only log them in verbose mode.
+template <typename Queue>
+void log_queue_stats(Queue* queue, uint64_t* last_total_dropped, bool show_drops) {
+  const XP::SharedQueueStats stats = queue->get_stats();
+  if (stats.total_dropped > *last_total_dropped && show_drops) {
+    LOG(ERROR) << (stats.total_dropped - *last_total_dropped) << " dropped: "
+               << queue->get_stats_string();
+  } else if (FLAGS_verbose) {
+    LOG(INFO) << queue->get_stats_string();
+  }
+  *last_total_dropped = stats.total_dropped;
+}
+
 bool kill_all_shared_queues() {
   imgs_for_saving_queue.kill();
   IR_imgs_for_saving_queue.kill();
@@ -549,6 +612,46 @@ bool kill_all_shared_queues() {
   return true;
 }
 
+// If g_save_all_frames, wait until the consumer of queue has popped all the queued frames.
+// Give up if it makes no progress for 5 sec, and log the frames left in the queue as dropped.
+template <typename Queue>
+void drain_queue(Queue* queue) {
+  if (!g_save_all_frames) {
+    return;
+  }
+  size_t size = queue->size();
+  std::chrono::time_point<steady_clock> progress_time = steady_clock::now();
+  while (size > 0) {
+    usleep(10000);  // sleep for 10ms
+    const size_t new_size = queue->size();
+    if (new_size < size) {
+      progress_time = steady_clock::now();
+    } else if (steady_clock::now() - progress_time > std::chrono::seconds(5)) {
+      LOG(ERROR) << new_size << " dropped at exit: " << queue->get_stats_string();
+      return;
+    }
+    size = new_size;
+  }
+}
+
+// Copy stereo_img (and z_mm if not empty) to imgs_for_saving_queue
+void push_stereo_img_for_save(const StereoImage& stereo_img, const cv::Mat& z_mm) {
+  uint64_t img_time_100us = static_cast<uint64_t>(stereo_img.ts_100us);
+  std::ostringstream ss;
+  ss << std::setfill('0') << std::setw(10) << img_time_100us;
+  ImgForSave img_for_save;
+  img_for_save.name = ss.str();
+  img_for_save.ts_100us = stereo_img.ts_100us;
+  // The channels are mono: 1, color: 3
+  XPDRIVER::ImageBufferPool& pool = XPDRIVER::ImageBufferPool::getInstance();
+  pool.copy(stereo_img.l, &img_for_save.l);
+  pool.copy(stereo_img.r, &img_for_save.r);
+  if (!z_mm.empty()) {
+    pool.copy(z_mm, &img_for_save.z_mm);
+  }
+  imgs_for_saving_queue.push_back(img_for_save);
+}
+
 // Threads
 void thread_proc_img() {
   VLOG(1) << "========= thread_proc_img thread starts";
@@ -609,8 +712,9 @@ void thread_proc_img() {
   if (FLAGS_depth || FLAGS_ir_depth) {
     depth_canvas.create(g_img_size.height, g_img_size.width, CV_8UC3);
   }
-  // for ORB detector
+  // for ORB detector.  The cam mask pyramids are built once by the pool.
   vector<cv::Mat_<uchar>> cam_mask_lr(2);
+  std::unique_ptr<XP::PyramidSetPool> pyramid_set_pool;
   if (g_calib_loaded) {
     for (int lr = 0; lr < 2; ++lr) {
       float fov_deg;
@@ -621,36 +725,60 @@ void thread_proc_img() {
                                   &fov_deg));
       LOG(INFO) << "Generate cam " << lr << " mask (fov: " << fov_deg << " deg)";
     }
+    if (FLAGS_orb_verify) {
+      pyramid_set_pool.reset(new XP::PyramidSetPool(calib_param.Camera.img_size, 2));
+      pyramid_set_pool->set_masks(cam_mask_lr[0], cam_mask_lr[1]);
+    }
   }
 
   size_t frame_counter = 0;
+  uint64_t stereo_image_queue_dropped = 0;
+  uint64_t imgs_for_saving_queue_dropped = 0;
+  uint64_t image_writer_dropped = 0;
   std::chrono::time_point<steady_clock> pre_proc_time = steady_clock::now();
   float thread_proc_img_rate = 0.f;
-  while (run_flag) {
+  // If g_save_all_frames, run until stereo_image_queue is drained and killed (see main)
+  while (run_flag || g_save_all_frames) {
     VLOG(1) << "========= thread_proc_img loop starts";
-    // check if the imgs queue is too long
-    bool pop_to_back = FLAGS_calib_verify || FLAGS_orb_verify;
-    if (stereo_image_queue.size() > 10) {
-      pop_to_back = true;
-      if (!FLAGS_depth && !FLAGS_ir_depth) {
-        // only show error if no additional computation is needed
-        LOG(ERROR) << "stereo_image_queue too long (" << stereo_image_queue.size()
-                   << "). Pop to back";
-      }
-    }
+    // stereo_image_queue keeps the latest images by itself if this thread falls behind, unless
+    // g_save_all_frames
     StereoImage stereo_img;
-    if (pop_to_back) {
+    if (FLAGS_calib_verify || FLAGS_orb_verify) {
       // record and calib_verify cannot be set at the same time
       if (!stereo_image_queue.wait_and_pop_to_back(&stereo_img)) {
         break;
       }
-      VLOG(1) << "stereo_image_queue.wait_and_pop_front done";
+      VLOG(1) << "stereo_image_queue.wait_and_pop_to_back done";
     } else {
       if (!stereo_image_queue.wait_and_pop_front(&stereo_img)) {
         break;
       }
       VLOG(1) << "stereo_image_queue.wait_and_pop_front done";
     }
+    maybe_bin_2x2(&stereo_img);
+    if (frame_counter % 100 == 0) {
+      // only show drops as errors if no additional computation is needed
+      log_queue_stats(&stereo_image_queue, &stereo_image_queue_dropped,
+                      !FLAGS_depth && !FLAGS_ir_depth);
+      log_queue_stats(&imgs_for_saving_queue, &imgs_for_saving_queue_dropped, false);
+      if (g_image_writer_pool) {
+        const XP::ImageWriterStats stats = g_image_writer_pool->get_stats();
+        if (stats.num_dropped > image_writer_dropped) {
+          LOG(ERROR) << (stats.num_dropped - image_writer_dropped) << " dropped: "
+                     << g_image_writer_pool->get_stats_string();
+        } else if (FLAGS_verbose) {
+          LOG(INFO) << g_image_writer_pool->get_stats_string();
+        }
+        image_writer_dropped = stats.num_dropped;
+      }
+    }
+    if (g_save_all_frames && (!run_flag || !stereo_image_queue.empty())) {
+      // Falling behind, or exiting: only save the frame (without Z) and skip its processing,
+      // so that the backlog goes to the image writer, which blocks or spills by save_overflow.
+      push_stereo_img_for_save(stereo_img, cv::Mat());
+      ++frame_counter;
+      continue;
+    }
 
     // Compute the processing rate
     if (frame_counter % 10 == 0) {
@@ -691,7 +819,7 @@ void thread_proc_img() {
       }
 
       if (FLAGS_calib_verify || FLAGS_orb_verify) {
-        verify_calibration(cam_mask_lr,
+        verify_calibration(pyramid_set_pool.get(),
                            proj_mat_lr,
                            calib_param,
                            img_l_mono,
@@ -721,8 +849,14 @@ void thread_proc_img() {
         StereoImage IR_latest_img;
         // Pop latest IR image for depth process
         if (!IR_depth_queue.wait_and_pop_to_back(&IR_latest_img)) {
+          if (g_save_all_frames) {
+            // Exiting (see main).  Still save this frame, and drain stereo_image_queue.
+            push_stereo_img_for_save(stereo_img, cv::Mat());
+            continue;
+          }
           break;
         }
+        maybe_bin_2x2(&IR_latest_img);
         img_l_ir = IR_latest_img.l;
         img_r_ir = IR_latest_img.r;
       }
@@ -799,17 +933,8 @@ void thread_proc_img() {
     }
 
     if (save_img) {
-      uint64_t img_time_100us = static_cast<uint64_t>(stereo_img.ts_100us);
-      std::ostringstream ss;
-      ss << std::setfill('0') << std::setw(10) << img_time_100us;
-      ImgForSave img_for_save;
-      img_for_save.name = ss.str();
-      img_for_save.l = stereo_img.l.clone();  // The channels are mono: 1, color: 3
-      img_for_save.r = stereo_img.r.clone();  // The channels are mono: 1, color: 3
-      if (FLAGS_depth || FLAGS_ir_depth) {
-          img_for_save.xyz = g_depth_xyz_img.clone();
-      }
-      imgs_for_saving_queue.push_back(img_for_save);
+      push_stereo_img_for_save(stereo_img, (FLAGS_depth || FLAGS_ir_depth) ?
+                               g_depth_z_mm_img : cv::Mat());
       save_img = false;  // reset
     }
     ++frame_counter;
@@ -832,29 +957,22 @@ void thread_proc_ir_img() {
   }
 
   size_t frame_counter = 0;
+  uint64_t IR_image_queue_dropped = 0;
   std::chrono::time_point<steady_clock> pre_proc_time = steady_clock::now();
   float thread_proc_img_rate = 0.f;
-  while (run_flag) {
+  // If g_save_all_frames, run until IR_image_queue is drained and killed (see main)
+  while (run_flag || g_save_all_frames) {
     VLOG(1) << "========= thread_proc_img loop starts";
-    // check if the ir imgs queue is too long
-    bool IR_pop_to_back = false;
-    if (IR_image_queue.size() > 10) {
-      IR_pop_to_back = true;
-      LOG(ERROR) << "IR_image_queue too long (" << IR_image_queue.size()
-                 << "). Pop to back";
-    }
+    // IR_image_queue keeps the latest images by itself if this thread falls behind, unless
+    // g_save_all_frames
     StereoImage IR_img;
-    if (IR_pop_to_back) {
-      // record and calib_verify cannot be set at the same time
-      if (!IR_image_queue.wait_and_pop_to_back(&IR_img)) {
-        break;
-      }
-      VLOG(1) << "IR_image_queue.wait_and_pop_front done";
-    } else {
-      if (!IR_image_queue.wait_and_pop_front(&IR_img)) {
-        break;
-      }
-      VLOG(1) << "IR_image_queue.wait_and_pop_front done";
+    if (!IR_image_queue.wait_and_pop_front(&IR_img)) {
+      break;
+    }
+    VLOG(1) << "IR_image_queue.wait_and_pop_front done";
+    maybe_bin_2x2(&IR_img);
+    if (frame_counter % 100 == 0) {
+      log_queue_stats(&IR_image_queue, &IR_image_queue_dropped, true);
     }
     // Compute the processing rate
     if (frame_counter % 10 == 0) {
@@ -896,8 +1014,10 @@ void thread_proc_ir_img() {
       std::ostringstream ss_IR;
       ss_IR << std::setfill('0') << std::setw(10) << IR_img_time_100us;
       IR_img_for_save.name = ss_IR.str();
-      IR_img_for_save.l = IR_img.l.clone();
-      IR_img_for_save.r = IR_img.r.clone();
+      IR_img_for_save.ts_100us = IR_img.ts_100us;
+      XPDRIVER::ImageBufferPool& pool = XPDRIVER::ImageBufferPool::getInstance();
+      pool.copy(IR_img.l, &IR_img_for_save.l);
+      pool.copy(IR_img.r, &IR_img_for_save.r);
       IR_imgs_for_saving_queue.push_back(IR_img_for_save);
       save_ir_img = false;  // reset
     }
@@ -925,9 +1045,11 @@ void thread_save_img() {
   const int valid_radius =
       sqrt(g_img_size.width * g_img_size.width + g_img_size.height * g_img_size.height) * 0.5
       * FLAGS_valid_ratio;
-  while (run_flag) {
+  // If g_save_all_frames, run until imgs_for_saving_queue is drained and killed (see main)
+  while (run_flag || g_save_all_frames) {
     ImgForSave img_for_save;
-    if (!imgs_for_saving_queue.wait_and_pop_to_back(&img_for_save)) {
+    // In order and without skipping.  The writer pool decides what to do if it falls behind.
+    if (!imgs_for_saving_queue.wait_and_pop_front(&img_for_save)) {
       break;
     }
     // verify coverage if calib_mode is on
@@ -1000,23 +1122,22 @@ void thread_save_img() {
       // Skip saving this stereo frame
       continue;
     }
-    cv::imwrite(FLAGS_record_path + "/l/" + img_for_save.name + ".png", img_for_save.l);
-    cv::imwrite(FLAGS_record_path + "/r/" + img_for_save.name + ".png", img_for_save.r);
-    if (img_for_save.xyz.rows > 0) {
-      // save Z val
-      cv::Mat_<uint16_t> z_img(img_for_save.xyz.size());
-      for (int i = 0; i < img_for_save.xyz.rows; ++i) {
-        for (int j = 0; j < img_for_save.xyz.cols; ++j) {
-          if (img_for_save.xyz.at<cv::Vec3f>(i, j)[2] < 1e-5) {
-            z_img(i, j) = 0;
-          } else {
-            // convert to mm
-            z_img(i, j) = img_for_save.xyz.at<cv::Vec3f>(i, j)[2] * 1000;
-          }
-        }
-      }
-      cv::imwrite(FLAGS_record_path + "/Z/" + img_for_save.name + ".png", z_img);
+    XP::ImageWriterPool::Frame frame;
+    if (g_dataset_writer) {
+      g_dataset_writer->add_stereo(img_for_save.ts_100us, img_for_save.l, img_for_save.r);
+    } else {
+      frame.emplace_back(FLAGS_record_path + "/l/" + img_for_save.name + ".png", img_for_save.l);
+      frame.emplace_back(FLAGS_record_path + "/r/" + img_for_save.name + ".png", img_for_save.r);
+    }
+    if (img_for_save.z_mm.rows > 0) {
+      frame.emplace_back(FLAGS_record_path + "/Z/" + img_for_save.name + ".png",
+                         img_for_save.z_mm);
+    }
+    if (!frame.empty()) {
+      g_image_writer_pool->push(frame);
     }
+    VLOG(1) << "ImageBufferPool hit " << XPDRIVER::ImageBufferPool::getInstance().hit_count()
+            << " miss " << XPDRIVER::ImageBufferPool::getInstance().miss_count();
     VLOG(1) << "========= thread_save_img loop ends";
   }
   VLOG(1) << "========= thread_save_img thread stops";
@@ -1028,13 +1149,19 @@ void thread_save_ir_img() {
   if (FLAGS_record_path.empty()) {
     return;
   }
-  while (run_flag) {
+  while (run_flag || g_save_all_frames) {
     ImgForSave img_for_save;
-    if (!IR_imgs_for_saving_queue.wait_and_pop_to_back(&img_for_save)) {
+    if (!IR_imgs_for_saving_queue.wait_and_pop_front(&img_for_save)) {
       break;
     }
-    cv::imwrite(FLAGS_record_path + "/l_IR/" + img_for_save.name + ".png", img_for_save.l);
-    cv::imwrite(FLAGS_record_path + "/r_IR/" + img_for_save.name + ".png", img_for_save.r);
+    if (g_dataset_writer) {
+      g_dataset_writer->add_stereo(img_for_save.ts_100us, img_for_save.l, img_for_save.r,
+                                   true /* IR */);
+    } else {
+      g_image_writer_pool->push(
+          {{FLAGS_record_path + "/l_IR/" + img_for_save.name + ".png", img_for_save.l},
+           {FLAGS_record_path + "/r_IR/" + img_for_save.name + ".png", img_for_save.r}});
+    }
     VLOG(1) << "========= thread_save_ir_img loop ends";
   }
   VLOG(1) << "========= thread_save_ir_img thread stops";
@@ -1044,38 +1171,55 @@ void thread_write_imu_data() {
   VLOG(1) << "========= thread_write_imu_data thread starts";
   // write imu data
   std::ofstream imu_fstream;
-  if (!FLAGS_record_path.empty()) {
-    imu_fstream.open((FLAGS_record_path + "/imu_data.txt").c_str(), std::iostream::trunc);
-    if (imu_fstream.is_open()) {
-      cout << "write to " << FLAGS_record_path + "/imu_data.txt " << endl;
+  XP::ImuLogWriter imu_log_writer;
+  bool has_imu_log = false;
+  if (!FLAGS_record_path.empty() && !g_dataset_writer) {
+    const std::string imu_file = FLAGS_record_path +
+        (FLAGS_imu_format == "binary" ? "/imu_data.bin" : "/imu_data.txt");
+    if (FLAGS_imu_format == "binary") {
+      has_imu_log = imu_log_writer.open(imu_file);
     } else {
-      cout << "Fail to open " << FLAGS_record_path + "/imu_data.txt " << endl;
+      imu_fstream.open(imu_file.c_str(), std::iostream::trunc);
+    }
+    if (has_imu_log || imu_fstream.is_open()) {
+      cout << "write to " << imu_file << endl;
+    } else {
+      cout << "Fail to open " << imu_file << endl;
     }
   }
+  uint64_t imu_dropped = 0;
   while (run_flag) {
     XPDRIVER::ImuData imu_data;
     if (!imu_data_queue.wait_and_pop_front(&imu_data)) {
       break;
     }
-    if (imu_fstream.is_open()) {
-      const int temperature = 999;  // a fake value
+    const uint64_t total_dropped = g_imu_dropped.load(std::memory_order_relaxed);
+    if (total_dropped > imu_dropped) {
+      LOG(ERROR) << "imu_data_queue is full. " << (total_dropped - imu_dropped)
+                 << " imu dropped before " << imu_data.time_stamp;
+      imu_dropped = total_dropped;
+    }
+    if (g_dataset_writer) {
+      g_dataset_writer->add_imu(imu_data);
+    } else if (has_imu_log) {
+      imu_log_writer.add(imu_data);
+    } else if (imu_fstream.is_open()) {
       // The imu timestamp is in 100us
       // accel is in m/s^2
       // angv is in rad/s
-      uint64_t ts_100us = static_cast<uint64_t>(imu_data.time_stamp);
-      imu_fstream << ts_100us << " "
-                  << imu_data.accel[0] << " "
-                  << imu_data.accel[1] << " "
-                  << imu_data.accel[2] << " "
-                  << imu_data.ang_v[0] << " "
-                  << imu_data.ang_v[1] << " "
-                  << imu_data.ang_v[2] << " "
-                  << temperature << endl;
+      // [NOTE] No endl, which would flush every sample.  ofstream flushes its buffer by itself.
+      XP::write_imu_text_line(imu_data, &imu_fstream);
     }
   }
+  if (g_imu_dropped.load() > imu_dropped) {
+    LOG(ERROR) << (g_imu_dropped.load() - imu_dropped) << " imu dropped at the end";
+  }
   if (imu_fstream.is_open()) {
     imu_fstream.close();
   }
+  if (has_imu_log) {
+    imu_log_writer.close();
+  }
   VLOG(1) << "========= thread_write_imu_data thread ends";
 }
 
@@ -1102,6 +1246,11 @@ bool auto_calib_load(const std::unique_ptr<XPDRIVER::XpSensorMultithread>& xp_se
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   google::ParseCommandLineFlags(&argc, &argv, true);
+  if (!FLAGS_imu_log_to_text.empty()) {
+    namespace fs = boost::filesystem;
+    const fs::path txt_path = fs::path(FLAGS_imu_log_to_text).parent_path() / "imu_data.txt";
+    return XP::convert_imu_log_to_text(FLAGS_imu_log_to_text, txt_path.string()) ? 0 : -1;
+  }
 
 #ifdef __ARM_NEON__
   if (FLAGS_cpu_core >= 0 && FLAGS_cpu_core < 8) {
@@ -1142,6 +1291,10 @@ int main(int argc, char** argv) {
   }
   if (FLAGS_depth || FLAGS_ir_depth || FLAGS_calib_verify || FLAGS_orb_verify) {
     g_calib_loaded = auto_calib_load(g_xp_sensor_ptr, FLAGS_calib_yaml, &g_calib_param);
+    if (g_calib_loaded && FLAGS_half_res) {
+      // Match the 2x2-binned images
+      g_calib_param.ConvertToHalfScale();
+    }
     if (!g_calib_loaded) {
       // some mode requires FLAGS_calib_yaml
       if (FLAGS_depth || FLAGS_ir_depth) {
@@ -1205,6 +1358,10 @@ int main(int argc, char** argv) {
     g_img_size.height = width;
     g_img_size.width = height;
   }
+  if (FLAGS_half_res) {
+    g_img_size.width /= 2;
+    g_img_size.height /= 2;
+  }
 
   g_has_IR = (XP_sensor_type == SensorType::XPIRL2 || XP_sensor_type == SensorType::XPIRL3);
   if (!FLAGS_record_path.empty()) {
@@ -1219,7 +1376,8 @@ int main(int argc, char** argv) {
     // case of spacebar_mode, as we may intend to continue saving images in the same
     // record path.
     fs::path imu_data_file(rec_path / "imu_data.txt");
-    if (fs::is_regular_file(imu_data_file) && !FLAGS_spacebar_mode) {
+    if ((fs::is_regular_file(imu_data_file) || fs::is_regular_file(rec_path / "imu_data.bin") ||
+         fs::is_regular_file(rec_path / "dataset.xpds")) && !FLAGS_spacebar_mode) {
       std::cout << "Found existing recording files at " << FLAGS_record_path << "\n";
       std::time_t t = std::time(NULL);
       char buf[32];
@@ -1232,12 +1390,48 @@ int main(int argc, char** argv) {
       }
     }
     namespace fs = boost::filesystem;
-    fs::create_directory(fs::path(FLAGS_record_path) / "l");
-    fs::create_directory(fs::path(FLAGS_record_path) / "r");
+    if (FLAGS_record_format == "dataset_raw" || FLAGS_record_format == "dataset_png") {
+      g_dataset_writer.reset(new XP::DatasetWriter(FLAGS_record_format == "dataset_png" ?
+                                                   XP::DatasetCodec::PNG :
+                                                   XP::DatasetCodec::RAW));
+      if (!g_dataset_writer->open(FLAGS_record_path + "/dataset.xpds")) {
+        return -1;
+      }
+    } else {
+      CHECK_EQ(FLAGS_record_format, "png") << "Unknown record_format";
+    }
+    CHECK(FLAGS_imu_format == "text" || FLAGS_imu_format == "binary") << "Unknown imu_format";
+    XP::ImageWriterOverflow save_overflow;
+    if (FLAGS_save_overflow == "drop") {
+      save_overflow = XP::ImageWriterOverflow::DROP;
+    } else if (FLAGS_save_overflow == "block") {
+      save_overflow = XP::ImageWriterOverflow::BLOCK;
+    } else {
+      CHECK_EQ(FLAGS_save_overflow, "spill") << "Unknown save_overflow";
+      save_overflow = XP::ImageWriterOverflow::SPILL;
+    }
+    g_save_all_frames = !FLAGS_spacebar_mode && save_overflow != XP::ImageWriterOverflow::DROP;
+    if (g_save_all_frames) {
+      // Bounded, and blocking instead of dropping.  The backlog goes to the image writer, which
+      // blocks (then so do these queues, up to the driver callbacks) or spills.
+      stereo_image_queue.set_capacity(kMaxQueuedImages, XP::OverflowPolicy::BLOCK_PRODUCER);
+      IR_image_queue.set_capacity(kMaxQueuedImages, XP::OverflowPolicy::BLOCK_PRODUCER);
+      imgs_for_saving_queue.set_capacity(kMaxPendingSaves, XP::OverflowPolicy::BLOCK_PRODUCER);
+      IR_imgs_for_saving_queue.set_capacity(kMaxPendingSaves,
+                                            XP::OverflowPolicy::BLOCK_PRODUCER);
+    }
+    // Also for the Z images of the dataset_* formats
+    g_image_writer_pool.reset(new XP::ImageWriterPool(FLAGS_save_workers, kMaxPendingSaves,
+                                                      save_overflow,
+                                                      FLAGS_record_path + "/spill.raw"));
+    if (!g_dataset_writer) {
+      fs::create_directory(fs::path(FLAGS_record_path) / "l");
+      fs::create_directory(fs::path(FLAGS_record_path) / "r");
+    }
     if (FLAGS_depth || FLAGS_ir_depth) {
       fs::create_directory(fs::path(FLAGS_record_path) / "Z");
     }
-    if (g_has_IR) {
+    if (g_has_IR && !g_dataset_writer) {
       fs::create_directory(fs::path(FLAGS_record_path) / "l_IR");
       fs::create_directory(fs::path(FLAGS_record_path) / "r_IR");
     }
@@ -1301,6 +1495,8 @@ int main(int argc, char** argv) {
   if (g_has_IR) {
     thread_pool.push_back(std::thread(thread_proc_ir_img));
   }
+  // The threads after them consume their output
+  const size_t num_proc_threads = thread_pool.size();
 
   if (!FLAGS_record_path.empty()) {
     g_xp_sensor_ptr->set_imu_data_callback(imu_data_callback);
@@ -1372,9 +1568,31 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Stop in the pipeline order.  If g_save_all_frames, each image queue is drained by its
+  // thread before it is killed, and the frames in flight get to the next queue.
+  run_flag = false;  // The callbacks push no more data
+  IR_depth_queue.kill();  // Only the latest IR image is used for depth anyway
+  drain_queue(&stereo_image_queue);
+  drain_queue(&IR_image_queue);
+  stereo_image_queue.kill();
+  IR_image_queue.kill();
+  for (size_t i = 0; i < num_proc_threads; ++i) {
+    thread_pool[i].join();
+  }
+  drain_queue(&imgs_for_saving_queue);
+  drain_queue(&IR_imgs_for_saving_queue);
   kill_all_shared_queues();
-  for (auto& t : thread_pool) {
-    t.join();
+  for (size_t i = num_proc_threads; i < thread_pool.size(); ++i) {
+    thread_pool[i].join();
+  }
+  if (g_dataset_writer) {
+    // Write the index.  Without it the reader falls back to scanning the records.
+    g_dataset_writer->close();
+  }
+  if (g_image_writer_pool) {
+    // Also encodes the spilled images, if any
+    g_image_writer_pool->stop();
+    LOG(INFO) << "Saved images: " << g_image_writer_pool->get_stats_string();
   }
   if (!g_xp_sensor_ptr->stop()) {
     LOG(ERROR) << "XpSensorMultithread failed to stop properly!";
@@ -1399,6 +1617,7 @@ int main(int argc, char** argv) {
   }
   if (FLAGS_depth || FLAGS_ir_depth) {
     g_depth_xyz_img.release();
+    g_depth_z_mm_img.release();
     g_disparity_img.release();
     g_disparity_buf.release();
     for (int i = 0; i < g_disparity_ml.size(); ++i) {
@@ -59,6 +59,8 @@ bool multilevel_stereoBM(const DuoCalibParam& duo_calib_param,
                          int end_level = 4,
                          cv::Mat* buf = nullptr);
 
+// For a whole disparity image, use colorize_disparity (disparity_reproject.h), which gives
+// the same colors with a lookup table
 inline cv::Vec3b depth16S2color(int16_t disparity16S) {
   if (disparity16S <= 0) {
     return cv::Vec3b(0, 0, 0);
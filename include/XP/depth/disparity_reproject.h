@@ -0,0 +1,328 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_DEPTH_DISPARITY_REPROJECT_H_
+#define XP_INCLUDE_XP_DEPTH_DISPARITY_REPROJECT_H_
+
+/*
+ * Disparity (CV_16SC1 in 1/16 pixel, as the outputs of depth_utils.h) to XYZ / Z in mm, and
+ * to a color image for display.
+ * [X Y Z W]^T = Q * [x y d 1]^T = (y * Q.col(1) + Q.col(3)) + x * Q.col(0) + d * Q.col(2),
+ * so the first term is computed once per row, and a pixel takes 2 multiply-adds per component
+ * and a divide, 4 pixels at a time.  The rows are split among the OpenCV threads.
+ */
+
+#include <driver/helper/cpu_features.h>
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <algorithm>
+#ifdef XP_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+#ifdef XP_HAS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace XP {
+
+namespace internal {
+
+// One row of disparity_to_xyz.  xyz and z_mm may be nullptr.
+// Invalid pixels (disparity <= 0) get (0, 0, 0) and 0 mm.
+typedef void (*ReprojectRowFunc)(const int16_t* disp, int cols, int y, const cv::Matx44f& Q,
+                                 float* xyz, uint16_t* z_mm);
+
+// Z in mm, saturated to uint16_t.  0 if Z < 1e-5 (too close or invalid).
+inline uint16_t z_to_mm(const float z) {
+  if (!(z >= 1e-5f)) {
+    return 0;
+  }
+  return static_cast<uint16_t>(std::min(z * 1000.f, 65535.f));
+}
+
+inline void reproject_pixel(const float base[4], const cv::Matx44f& Q, const int x,
+                            const int16_t disp, float* xyz, uint16_t* z_mm) {
+  float out[3] = {0.f, 0.f, 0.f};
+  if (disp > 0) {
+    const float d = disp * (1.f / 16.f);
+    const float w = base[3] + x * Q(3, 0) + d * Q(3, 2);
+    const float inv_w = 1.f / w;
+    for (int k = 0; k < 3; ++k) {
+      out[k] = (base[k] + x * Q(k, 0) + d * Q(k, 2)) * inv_w;
+    }
+  }
+  if (xyz != nullptr) {
+    xyz[0] = out[0];
+    xyz[1] = out[1];
+    xyz[2] = out[2];
+  }
+  if (z_mm != nullptr) {
+    *z_mm = z_to_mm(out[2]);
+  }
+}
+
+inline void row_base(const int y, const cv::Matx44f& Q, float base[4]) {
+  for (int k = 0; k < 4; ++k) {
+    base[k] = y * Q(k, 1) + Q(k, 3);
+  }
+}
+
+inline void reproject_row_scalar(const int16_t* disp, const int cols, const int y,
+                                 const cv::Matx44f& Q, float* xyz, uint16_t* z_mm) {
+  float base[4];
+  row_base(y, Q, base);
+  for (int x = 0; x < cols; ++x) {
+    reproject_pixel(base, Q, x, disp[x], xyz ? xyz + 3 * x : nullptr,
+                    z_mm ? z_mm + x : nullptr);
+  }
+}
+
+#ifdef XP_HAS_X86_SIMD
+XP_TARGET_SSE41
+inline void reproject_row_sse41(const int16_t* disp, const int cols, const int y,
+                                const cv::Matx44f& Q, float* xyz, uint16_t* z_mm) {
+  float base[4];
+  row_base(y, Q, base);
+  // Named registers rather than arrays, which gcc -O2 keeps in memory
+  const __m128 v_base_x = _mm_set1_ps(base[0]);
+  const __m128 v_base_y = _mm_set1_ps(base[1]);
+  const __m128 v_base_z = _mm_set1_ps(base[2]);
+  const __m128 v_base_w = _mm_set1_ps(base[3]);
+  const __m128 v_qx_x = _mm_set1_ps(Q(0, 0));
+  const __m128 v_qx_y = _mm_set1_ps(Q(1, 0));
+  const __m128 v_qx_z = _mm_set1_ps(Q(2, 0));
+  const __m128 v_qx_w = _mm_set1_ps(Q(3, 0));
+  const __m128 v_qd_x = _mm_set1_ps(Q(0, 2));
+  const __m128 v_qd_y = _mm_set1_ps(Q(1, 2));
+  const __m128 v_qd_z = _mm_set1_ps(Q(2, 2));
+  const __m128 v_qd_w = _mm_set1_ps(Q(3, 2));
+  const __m128 v_one = _mm_set1_ps(1.f);
+  const __m128 v_inv16 = _mm_set1_ps(1.f / 16.f);
+  const __m128 v_min_z = _mm_set1_ps(1e-5f);
+  const __m128 v_1000 = _mm_set1_ps(1000.f);
+  const __m128 v_max_mm = _mm_set1_ps(65535.f);
+  const __m128 v_step = _mm_set1_ps(4.f);
+  __m128 v_x = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+  int x = 0;
+  // The 4th pixel is stored as 4 floats, i.e., one beyond its XYZ, so leave 1 pixel for the
+  // scalar tail
+  for (; x + 5 <= cols; x += 4) {
+    const __m128i v_disp = _mm_cvtepi16_epi32(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(disp + x)));
+    const __m128 v_valid = _mm_castsi128_ps(_mm_cmpgt_epi32(v_disp, _mm_setzero_si128()));
+    const __m128 v_d = _mm_mul_ps(_mm_cvtepi32_ps(v_disp), v_inv16);
+    const __m128 v_w = _mm_add_ps(_mm_add_ps(v_base_w, _mm_mul_ps(v_x, v_qx_w)),
+                                  _mm_mul_ps(v_d, v_qd_w));
+    const __m128 v_inv_w = _mm_div_ps(v_one, v_w);
+    // Invalid pixels are zeroed after the divide
+    const __m128 v_X = _mm_and_ps(_mm_mul_ps(_mm_add_ps(
+        _mm_add_ps(v_base_x, _mm_mul_ps(v_x, v_qx_x)), _mm_mul_ps(v_d, v_qd_x)), v_inv_w), v_valid);
+    const __m128 v_Y = _mm_and_ps(_mm_mul_ps(_mm_add_ps(
+        _mm_add_ps(v_base_y, _mm_mul_ps(v_x, v_qx_y)), _mm_mul_ps(v_d, v_qd_y)), v_inv_w), v_valid);
+    const __m128 v_Z = _mm_and_ps(_mm_mul_ps(_mm_add_ps(
+        _mm_add_ps(v_base_z, _mm_mul_ps(v_x, v_qx_z)), _mm_mul_ps(v_d, v_qd_z)), v_inv_w), v_valid);
+    if (z_mm != nullptr) {
+      // 0 if Z < 1e-5, like z_to_mm.  The clamp keeps the int32 -> uint16 pack exact.
+      const __m128 v_z_ok = _mm_cmpge_ps(v_Z, v_min_z);
+      const __m128 v_mm = _mm_and_ps(_mm_min_ps(_mm_mul_ps(v_Z, v_1000), v_max_mm),
+                                     v_z_ok);
+      const __m128i v_mm32 = _mm_cvttps_epi32(v_mm);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(z_mm + x),
+                       _mm_packus_epi32(v_mm32, v_mm32));
+    }
+    if (xyz != nullptr) {
+      __m128 p0 = v_X, p1 = v_Y, p2 = v_Z, p3 = _mm_setzero_ps();
+      _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+      float* dst = xyz + 3 * x;
+      _mm_storeu_ps(dst, p0);
+      _mm_storeu_ps(dst + 3, p1);
+      _mm_storeu_ps(dst + 6, p2);
+      _mm_storeu_ps(dst + 9, p3);
+    }
+    v_x = _mm_add_ps(v_x, v_step);
+  }
+  for (; x < cols; ++x) {
+    reproject_pixel(base, Q, x, disp[x], xyz ? xyz + 3 * x : nullptr,
+                    z_mm ? z_mm + x : nullptr);
+  }
+}
+#endif  // XP_HAS_X86_SIMD
+
+#ifdef XP_HAS_NEON
+inline void reproject_row_neon(const int16_t* disp, const int cols, const int y,
+                               const cv::Matx44f& Q, float* xyz, uint16_t* z_mm) {
+  float base[4];
+  row_base(y, Q, base);
+  float32x4_t v_base[4], v_qx[4], v_qd[4];
+  for (int k = 0; k < 4; ++k) {
+    v_base[k] = vdupq_n_f32(base[k]);
+    v_qx[k] = vdupq_n_f32(Q(k, 0));
+    v_qd[k] = vdupq_n_f32(Q(k, 2));
+  }
+  const float32x4_t v_min_z = vdupq_n_f32(1e-5f);
+  const float32x4_t v_max_mm = vdupq_n_f32(65535.f);
+  const float32x4_t v_step = vdupq_n_f32(4.f);
+  const float x_init[4] = {0.f, 1.f, 2.f, 3.f};
+  float32x4_t v_x = vld1q_f32(x_init);
+  int x = 0;
+  for (; x + 4 <= cols; x += 4) {
+    const int32x4_t v_disp = vmovl_s16(vld1_s16(disp + x));
+    const uint32x4_t v_valid = vcgtq_s32(v_disp, vdupq_n_s32(0));
+    const float32x4_t v_d = vmulq_n_f32(vcvtq_f32_s32(v_disp), 1.f / 16.f);
+    float32x4_t v_out[4];
+    for (int k = 0; k < 4; ++k) {
+      v_out[k] = vmlaq_f32(vmlaq_f32(v_base[k], v_x, v_qx[k]), v_d, v_qd[k]);
+    }
+#ifdef __aarch64__
+    const float32x4_t v_inv_w = vdivq_f32(vdupq_n_f32(1.f), v_out[3]);
+#else
+    // 2 Newton-Raphson steps give ~full float precision
+    float32x4_t v_inv_w = vrecpeq_f32(v_out[3]);
+    v_inv_w = vmulq_f32(vrecpsq_f32(v_out[3], v_inv_w), v_inv_w);
+    v_inv_w = vmulq_f32(vrecpsq_f32(v_out[3], v_inv_w), v_inv_w);
+#endif
+    float32x4x3_t v_xyz;
+    for (int k = 0; k < 3; ++k) {
+      v_xyz.val[k] = vreinterpretq_f32_u32(vandq_u32(
+          vreinterpretq_u32_f32(vmulq_f32(v_out[k], v_inv_w)), v_valid));
+    }
+    if (z_mm != nullptr) {
+      const uint32x4_t v_z_ok = vcgeq_f32(v_xyz.val[2], v_min_z);
+      const float32x4_t v_mm = vminq_f32(vmulq_n_f32(v_xyz.val[2], 1000.f), v_max_mm);
+      const uint32x4_t v_mm32 = vandq_u32(vcvtq_u32_f32(v_mm), v_z_ok);
+      vst1_u16(z_mm + x, vmovn_u32(v_mm32));
+    }
+    if (xyz != nullptr) {
+      vst3q_f32(xyz + 3 * x, v_xyz);
+    }
+    v_x = vaddq_f32(v_x, v_step);
+  }
+  for (; x < cols; ++x) {
+    reproject_pixel(base, Q, x, disp[x], xyz ? xyz + 3 * x : nullptr,
+                    z_mm ? z_mm + x : nullptr);
+  }
+}
+#endif  // XP_HAS_NEON
+
+inline ReprojectRowFunc select_reproject_row() {
+  static const XPDRIVER::SimdIsa isa = XPDRIVER::detect_simd_isa();
+#ifdef XP_HAS_X86_SIMD
+  if (isa == XPDRIVER::SimdIsa::SSE4_1 || isa == XPDRIVER::SimdIsa::AVX2) {
+    return reproject_row_sse41;
+  }
+#endif
+#ifdef XP_HAS_NEON
+  if (isa == XPDRIVER::SimdIsa::NEON) {
+    return reproject_row_neon;
+  }
+#endif
+  (void)isa;
+  return reproject_row_scalar;
+}
+
+class ReprojectRows : public cv::ParallelLoopBody {
+ public:
+  ReprojectRows(const cv::Mat& disparity, const cv::Matx44f& Q, cv::Mat* xyz, cv::Mat* z_mm) :
+      disparity_(disparity), Q_(Q), xyz_(xyz), z_mm_(z_mm), row_func_(select_reproject_row()) {}
+
+  void operator()(const cv::Range& range) const override {
+    for (int y = range.start; y < range.end; ++y) {
+      row_func_(disparity_.ptr<int16_t>(y), disparity_.cols, y, Q_,
+                xyz_ ? xyz_->ptr<float>(y) : nullptr,
+                z_mm_ ? z_mm_->ptr<uint16_t>(y) : nullptr);
+    }
+  }
+
+ private:
+  const cv::Mat& disparity_;
+  const cv::Matx44f Q_;
+  cv::Mat* xyz_;
+  cv::Mat* z_mm_;
+  const ReprojectRowFunc row_func_;
+};
+}  // namespace internal
+
+// Same as cv::reprojectImageTo3D, but invalid pixels (disparity <= 0) get (0, 0, 0).
+// disparity: CV_16SC1 in 1/16 pixel
+// Q: DuoCalibParam::Camera.Q of the same resolution as disparity
+// xyz: CV_32FC3 in meter.  Can be nullptr.
+// z_mm: CV_16UC1 Z in mm, for saving as png.  0 if invalid, saturated at 65535.  Can be nullptr.
+inline void disparity_to_xyz(const cv::Mat& disparity, const cv::Matx44f& Q,
+                             cv::Mat* xyz, cv::Mat* z_mm = nullptr) {
+  CV_Assert(disparity.type() == CV_16SC1);
+  if (xyz != nullptr) {
+    xyz->create(disparity.size(), CV_32FC3);
+  }
+  if (z_mm != nullptr) {
+    z_mm->create(disparity.size(), CV_16UC1);
+  }
+  cv::parallel_for_(cv::Range(0, disparity.rows),
+                    internal::ReprojectRows(disparity, Q, xyz, z_mm));
+}
+
+// The colors of depth16S2color (depth_utils.h) for the 256 levels of
+// disparity16S * 255 / (64 * 16), so the per-pixel math becomes a table lookup
+struct DepthColorLut {
+  cv::Vec3b colors[256];
+
+  DepthColorLut() {
+    for (int val = 0; val < 256; ++val) {
+      uchar r = 0, g = 0, b = 0;
+      if (val > 128) {
+        r = (val - 128) * 2;
+        b = (255 - val) * 2;
+      } else {
+        b = (val) * 2;
+        g = (128 - val) * 2;
+      }
+      colors[val] = cv::Vec3b(b, g, r);
+    }
+  }
+
+  // Level 0 is black, so invalid disparities (<= 0) need no branch
+  static inline int level(const int16_t disparity16S) {
+    // max_disp_pixel = 64, and the opencv disparity in 16S is multiplied by 16
+    return std::min(std::max(static_cast<int>(disparity16S), 0) * 255 >> 10, 255);
+  }
+
+  inline cv::Vec3b operator()(const int16_t disparity16S) const {
+    return colors[level(disparity16S)];
+  }
+};
+
+inline const DepthColorLut& depth_color_lut() {
+  static const DepthColorLut lut;
+  return lut;
+}
+
+// Same as depth16S2color of every pixel.  canvas is CV_8UC3.
+inline void colorize_disparity(const cv::Mat& disparity, cv::Mat* canvas) {
+  CV_Assert(disparity.type() == CV_16SC1);
+  canvas->create(disparity.size(), CV_8UC3);
+  const DepthColorLut& lut = depth_color_lut();
+  for (int y = 0; y < disparity.rows; ++y) {
+    const int16_t* disp = disparity.ptr<int16_t>(y);
+    uchar* dst = canvas->ptr<uchar>(y);
+    for (int x = 0; x < disparity.cols; ++x) {
+      const uchar* color = &lut.colors[DepthColorLut::level(disp[x])][0];
+      dst[3 * x] = color[0];
+      dst[3 * x + 1] = color[1];
+      dst[3 * x + 2] = color[2];
+    }
+  }
+}
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_DEPTH_DISPARITY_REPROJECT_H_
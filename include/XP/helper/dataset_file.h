@@ -0,0 +1,526 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_HELPER_DATASET_FILE_H_
+#define XP_INCLUDE_XP_HELPER_DATASET_FILE_H_
+
+/*
+ * A single-file container for a recording (stereo images, IR images and IMU), to replace
+ * the folders of per-frame PNG files plus imu_data.txt.
+ * Layout: [file header (4 KB)] [chunk] [chunk] ... [index] [footer]
+ * - Records are packed into chunks of ~4 MB written with one write() each.  Every chunk starts
+ *   at a page boundary and every payload starts at a 64-byte boundary, so a RAW image can be
+ *   used in place from an mmap of the file (no copy, no decode).
+ * - The index maps the timestamp of every record to its offset, sorted by time, so a reader
+ *   neither lists nor opens anything but this file.  If the footer is missing (e.g., the
+ *   recorder was killed), the reader rebuilds the index by scanning the records.
+ * - The images are stored as is (RAW) or losslessly compressed per frame (PNG).
+ */
+
+#include <driver/basic_datatype.h>  // For XPDRIVER::ImuData
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace XP {
+
+constexpr char kDatasetMagic[8] = {'X', 'P', 'D', 'A', 'T', 'A', 'S', 'T'};
+constexpr uint32_t kDatasetVersion = 1;
+constexpr uint32_t kDatasetRecordMagic = 0x43455258;  // "XREC"
+constexpr uint32_t kDatasetFooterMagic = 0x58444e49;  // "INDX"
+constexpr size_t kDatasetPayloadAlignment = 64;
+constexpr size_t kDatasetChunkAlignment = 4096;
+
+enum class DatasetRecordType : uint16_t {
+  STEREO = 1,
+  STEREO_IR = 2,
+  IMU = 3
+};
+
+enum class DatasetCodec : uint16_t {
+  RAW = 0,
+  PNG = 1
+};
+
+struct DatasetFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunk_alignment;
+  uint32_t payload_alignment;
+  uint32_t reserved[11];
+};
+static_assert(sizeof(DatasetFileHeader) == 64, "DatasetFileHeader must be 64 bytes");
+
+// Followed by the payload.  Stereo: the left image, then the right image at the next 64-byte
+// boundary.  IMU: count XPDRIVER::ImuData.
+struct DatasetRecordHeader {
+  uint32_t magic;
+  uint16_t type;  // DatasetRecordType
+  uint16_t codec;  // DatasetCodec.  Always RAW for IMU.
+  uint64_t ts_100us;  // The image time, or the first IMU sample time
+  uint64_t payload_size;  // Without the padding
+  uint32_t count;  // The number of IMU samples.  2 for stereo.
+  uint16_t rows;
+  uint16_t cols;
+  int32_t cv_type;
+  uint32_t size[2];  // The (encoded) size of the left / right image
+  uint8_t reserved[20];
+};
+static_assert(sizeof(DatasetRecordHeader) == 64, "DatasetRecordHeader must be 64 bytes");
+static_assert(sizeof(XPDRIVER::ImuData) == 28, "XPDRIVER::ImuData is stored as is");
+
+struct DatasetIndexEntry {
+  uint64_t ts_100us;
+  uint64_t offset;  // Of the DatasetRecordHeader
+  uint16_t type;  // DatasetRecordType
+  uint16_t reserved[3];
+};
+static_assert(sizeof(DatasetIndexEntry) == 24, "DatasetIndexEntry must be 24 bytes");
+
+// The last bytes of the file
+struct DatasetFooter {
+  uint64_t index_offset;
+  uint64_t num_entries;
+  uint32_t magic;
+  uint32_t version;
+};
+static_assert(sizeof(DatasetFooter) == 24, "DatasetFooter must be 24 bytes");
+
+inline size_t dataset_aligned_size(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Thread-safe, e.g., the images and the IMU can be added from different threads
+class DatasetWriter {
+ public:
+  DatasetWriter& operator=(const DatasetWriter&) = delete;
+  DatasetWriter(const DatasetWriter& other) = delete;
+
+  // chunk_size: the records are written in chunks of about this size
+  explicit DatasetWriter(const DatasetCodec codec = DatasetCodec::RAW,
+                         const size_t chunk_size = 4 << 20) :
+      codec_(codec), chunk_size_(chunk_size), fd_(-1), file_offset_(0) {}
+  ~DatasetWriter() { close(); }
+
+  bool open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(m_);
+    if (fd_ >= 0) {
+      LOG(ERROR) << "DatasetWriter is already open";
+      return false;
+    }
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      LOG(ERROR) << "Cannot open " << path;
+      return false;
+    }
+    DatasetFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kDatasetMagic, sizeof(header.magic));
+    header.version = kDatasetVersion;
+    header.chunk_alignment = kDatasetChunkAlignment;
+    header.payload_alignment = kDatasetPayloadAlignment;
+    chunk_.clear();
+    chunk_.reserve(chunk_size_);
+    index_.clear();
+    imu_batch_.clear();
+    chunk_.resize(kDatasetChunkAlignment, 0);
+    memcpy(chunk_.data(), &header, sizeof(header));
+    file_offset_ = 0;
+    return flush_chunk();
+  }
+
+  // The pending IMU samples are written before the images, so a reader that replays the
+  // index in time order gets the IMU up to (and maybe a bit beyond) the image time first.
+  bool add_stereo(const float ts_100us, const cv::Mat& img_l, const cv::Mat& img_r,
+                  const bool IR = false) {
+    CHECK_EQ(img_l.type(), img_r.type());
+    CHECK_EQ(img_l.size(), img_r.size());
+    std::vector<uchar> encoded[2];
+    const cv::Mat* imgs[2] = {&img_l, &img_r};
+    DatasetRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kDatasetRecordMagic;
+    header.type = static_cast<uint16_t>(IR ? DatasetRecordType::STEREO_IR
+                                           : DatasetRecordType::STEREO);
+    header.codec = static_cast<uint16_t>(codec_);
+    header.ts_100us = static_cast<uint64_t>(ts_100us);
+    header.count = 2;
+    header.rows = static_cast<uint16_t>(img_l.rows);
+    header.cols = static_cast<uint16_t>(img_l.cols);
+    header.cv_type = img_l.type();
+    // Encode before taking the lock
+    for (int lr = 0; lr < 2; ++lr) {
+      if (codec_ == DatasetCodec::PNG) {
+        // Level 1: most of the size gain of PNG at a fraction of the default CPU time
+        if (!cv::imencode(".png", *imgs[lr], encoded[lr], {cv::IMWRITE_PNG_COMPRESSION, 1})) {
+          LOG(ERROR) << "DatasetWriter fails to encode " << ts_100us;
+          return false;
+        }
+        header.size[lr] = static_cast<uint32_t>(encoded[lr].size());
+      } else {
+        header.size[lr] = static_cast<uint32_t>(imgs[lr]->total() * imgs[lr]->elemSize());
+      }
+    }
+    header.payload_size = dataset_aligned_size(header.size[0], kDatasetPayloadAlignment) +
+        header.size[1];
+    std::lock_guard<std::mutex> lock(m_);
+    if (fd_ < 0) {
+      return false;
+    }
+    if (!flush_imu_batch()) {
+      return false;
+    }
+    uint8_t* payload = begin_record(header);
+    if (payload == nullptr) {
+      return false;
+    }
+    for (int lr = 0; lr < 2; ++lr) {
+      uint8_t* dst = payload +
+          (lr == 0 ? 0 : dataset_aligned_size(header.size[0], kDatasetPayloadAlignment));
+      if (codec_ == DatasetCodec::PNG) {
+        memcpy(dst, encoded[lr].data(), encoded[lr].size());
+      } else {
+        // Row by row, in case the image is a ROI
+        const cv::Mat& img = *imgs[lr];
+        const size_t row_size = img.cols * img.elemSize();
+        for (int r = 0; r < img.rows; ++r) {
+          memcpy(dst + r * row_size, img.ptr(r), row_size);
+        }
+      }
+    }
+    return end_record();
+  }
+
+  // Buffered and written as one IMU record before the next images (or every kMaxImuBatch
+  // samples)
+  bool add_imu(const XPDRIVER::ImuData& imu_data) {
+    std::lock_guard<std::mutex> lock(m_);
+    if (fd_ < 0) {
+      return false;
+    }
+    imu_batch_.push_back(imu_data);
+    if (imu_batch_.size() >= kMaxImuBatch) {
+      return flush_imu_batch();
+    }
+    return true;
+  }
+
+  // Write the pending data, the index and the footer
+  bool close() {
+    std::lock_guard<std::mutex> lock(m_);
+    if (fd_ < 0) {
+      return false;
+    }
+    bool ok = flush_imu_batch() && flush_chunk();
+    if (ok) {
+      std::stable_sort(index_.begin(), index_.end(),
+                       [](const DatasetIndexEntry& a, const DatasetIndexEntry& b) {
+                         return a.ts_100us < b.ts_100us;
+                       });
+      DatasetFooter footer;
+      footer.index_offset = file_offset_;
+      footer.num_entries = index_.size();
+      footer.magic = kDatasetFooterMagic;
+      footer.version = kDatasetVersion;
+      ok = write_all(index_.data(), index_.size() * sizeof(DatasetIndexEntry)) &&
+          write_all(&footer, sizeof(footer));
+    }
+    ::close(fd_);
+    fd_ = -1;
+    return ok;
+  }
+
+  size_t num_records() {
+    std::lock_guard<std::mutex> lock(m_);
+    return index_.size();
+  }
+
+ private:
+  static constexpr size_t kMaxImuBatch = 1000;
+
+  bool write_all(const void* data, size_t size) {
+    const uint8_t* ptr = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+      const ssize_t written = ::write(fd_, ptr, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG(ERROR) << "DatasetWriter fails to write: " << strerror(errno);
+        return false;
+      }
+      ptr += written;
+      size -= written;
+      file_offset_ += written;
+    }
+    return true;
+  }
+
+  // Write chunk_ padded to the next chunk boundary
+  bool flush_chunk() {
+    if (chunk_.empty()) {
+      return true;
+    }
+    chunk_.resize(dataset_aligned_size(chunk_.size(), kDatasetChunkAlignment), 0);
+    const bool ok = write_all(chunk_.data(), chunk_.size());
+    chunk_.clear();
+    return ok;
+  }
+
+  // Append the header and room for the padded payload to chunk_.  Return the payload.
+  uint8_t* begin_record(const DatasetRecordHeader& header) {
+    const size_t record_size = sizeof(header) +
+        dataset_aligned_size(header.payload_size, kDatasetPayloadAlignment);
+    if (!chunk_.empty() && chunk_.size() + record_size > chunk_size_) {
+      if (!flush_chunk()) {
+        return nullptr;
+      }
+    }
+    DatasetIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.ts_100us = header.ts_100us;
+    entry.offset = file_offset_ + chunk_.size();
+    entry.type = header.type;
+    index_.push_back(entry);
+    const size_t record_offset = chunk_.size();
+    chunk_.resize(record_offset + record_size, 0);
+    memcpy(chunk_.data() + record_offset, &header, sizeof(header));
+    return chunk_.data() + record_offset + sizeof(header);
+  }
+
+  bool end_record() {
+    // A record larger than a chunk goes out right away
+    return chunk_.size() < chunk_size_ || flush_chunk();
+  }
+
+  bool flush_imu_batch() {
+    if (imu_batch_.empty()) {
+      return true;
+    }
+    DatasetRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kDatasetRecordMagic;
+    header.type = static_cast<uint16_t>(DatasetRecordType::IMU);
+    header.codec = static_cast<uint16_t>(DatasetCodec::RAW);
+    header.ts_100us = static_cast<uint64_t>(imu_batch_.front().time_stamp);
+    header.count = static_cast<uint32_t>(imu_batch_.size());
+    header.payload_size = imu_batch_.size() * sizeof(XPDRIVER::ImuData);
+    uint8_t* payload = begin_record(header);
+    if (payload == nullptr) {
+      return false;
+    }
+    memcpy(payload, imu_batch_.data(), header.payload_size);
+    imu_batch_.clear();
+    return end_record();
+  }
+
+  const DatasetCodec codec_;
+  const size_t chunk_size_;
+  std::mutex m_;
+  int fd_;
+  uint64_t file_offset_;  // Of the first byte of chunk_
+  std::vector<uint8_t> chunk_;
+  std::vector<DatasetIndexEntry> index_;
+  std::vector<XPDRIVER::ImuData> imu_batch_;
+};
+
+// Read-only access to a dataset file through an mmap.  The records can be read from several
+// threads at the same time.
+class DatasetReader {
+ public:
+  DatasetReader& operator=(const DatasetReader&) = delete;
+  DatasetReader(const DatasetReader& other) = delete;
+
+  DatasetReader() : data_(nullptr), size_(0) {}
+  ~DatasetReader() { close(); }
+
+  bool open(const std::string& path) {
+    close();
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      LOG(ERROR) << "Cannot open " << path;
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kDatasetChunkAlignment)) {
+      LOG(ERROR) << path << " is not a dataset file";
+      ::close(fd);
+      return false;
+    }
+    size_ = st.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      LOG(ERROR) << "Cannot mmap " << path;
+      size_ = 0;
+      return false;
+    }
+    data_ = static_cast<const uint8_t*>(data);
+    const DatasetFileHeader* header = reinterpret_cast<const DatasetFileHeader*>(data_);
+    if (memcmp(header->magic, kDatasetMagic, sizeof(kDatasetMagic)) != 0 ||
+        header->version != kDatasetVersion) {
+      LOG(ERROR) << path << " is not a dataset file of version " << kDatasetVersion;
+      close();
+      return false;
+    }
+    if (!load_index()) {
+      LOG(WARNING) << path << " has no index (the recording was interrupted?).  Scanning...";
+      scan_index();
+    }
+    // The records are mostly replayed in order
+    madvise(const_cast<uint8_t*>(data_), size_, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  void close() {
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+      data_ = nullptr;
+      size_ = 0;
+    }
+    index_.clear();
+  }
+
+  // In time order
+  size_t size() const { return index_.size(); }
+  const DatasetIndexEntry& entry(const size_t i) const { return index_.at(i); }
+  DatasetRecordType type(const size_t i) const {
+    return static_cast<DatasetRecordType>(index_.at(i).type);
+  }
+
+  // A RAW image is returned as a cv::Mat header on the mmap, i.e., with no copy.  It is valid
+  // until close() and must not be written to.  A PNG image is decoded.
+  bool read_stereo(const size_t i, cv::Mat* img_l, cv::Mat* img_r, float* ts_100us) const {
+    const DatasetRecordHeader* header = record(i);
+    if (header == nullptr || header->type == static_cast<uint16_t>(DatasetRecordType::IMU)) {
+      return false;
+    }
+    const uint8_t* payload = reinterpret_cast<const uint8_t*>(header + 1);
+    cv::Mat* imgs[2] = {img_l, img_r};
+    for (int lr = 0; lr < 2; ++lr) {
+      const uint8_t* src = payload +
+          (lr == 0 ? 0 : dataset_aligned_size(header->size[0], kDatasetPayloadAlignment));
+      if (header->codec == static_cast<uint16_t>(DatasetCodec::PNG)) {
+        const cv::Mat encoded(1, header->size[lr], CV_8UC1, const_cast<uint8_t*>(src));
+        *imgs[lr] = cv::imdecode(encoded, cv::IMREAD_UNCHANGED);
+        if (imgs[lr]->empty()) {
+          LOG(ERROR) << "Fails to decode record " << i;
+          return false;
+        }
+      } else {
+        *imgs[lr] = cv::Mat(header->rows, header->cols, header->cv_type,
+                            const_cast<uint8_t*>(src));
+      }
+    }
+    if (ts_100us != nullptr) {
+      *ts_100us = static_cast<float>(header->ts_100us);
+    }
+    return true;
+  }
+
+  // The samples are appended to imu_samples
+  bool read_imu(const size_t i, std::vector<XPDRIVER::ImuData>* imu_samples) const {
+    const DatasetRecordHeader* header = record(i);
+    if (header == nullptr || header->type != static_cast<uint16_t>(DatasetRecordType::IMU)) {
+      return false;
+    }
+    const XPDRIVER::ImuData* samples = reinterpret_cast<const XPDRIVER::ImuData*>(header + 1);
+    imu_samples->insert(imu_samples->end(), samples, samples + header->count);
+    return true;
+  }
+
+ private:
+  // nullptr if the record is corrupted
+  const DatasetRecordHeader* record(const size_t i) const {
+    const uint64_t offset = index_.at(i).offset;
+    if (offset + sizeof(DatasetRecordHeader) > size_) {
+      return nullptr;
+    }
+    const DatasetRecordHeader* header =
+        reinterpret_cast<const DatasetRecordHeader*>(data_ + offset);
+    if (header->magic != kDatasetRecordMagic ||
+        offset + sizeof(DatasetRecordHeader) + header->payload_size > size_) {
+      LOG(ERROR) << "Corrupted record " << i << " at " << offset;
+      return nullptr;
+    }
+    return header;
+  }
+
+  bool load_index() {
+    if (size_ < kDatasetChunkAlignment + sizeof(DatasetFooter)) {
+      return false;
+    }
+    const DatasetFooter* footer =
+        reinterpret_cast<const DatasetFooter*>(data_ + size_ - sizeof(DatasetFooter));
+    if (footer->magic != kDatasetFooterMagic || footer->version != kDatasetVersion ||
+        footer->index_offset + footer->num_entries * sizeof(DatasetIndexEntry) +
+        sizeof(DatasetFooter) != size_) {
+      return false;
+    }
+    const DatasetIndexEntry* entries =
+        reinterpret_cast<const DatasetIndexEntry*>(data_ + footer->index_offset);
+    index_.assign(entries, entries + footer->num_entries);
+    return true;
+  }
+
+  // Walk the records chunk by chunk.  A chunk ends at the first non-record offset, and the
+  // file ends at the first chunk that does not start with a complete record.
+  void scan_index() {
+    index_.clear();
+    uint64_t offset = kDatasetChunkAlignment;
+    while (offset + sizeof(DatasetRecordHeader) <= size_) {
+      const DatasetRecordHeader* header =
+          reinterpret_cast<const DatasetRecordHeader*>(data_ + offset);
+      const uint64_t record_size = sizeof(DatasetRecordHeader) +
+          dataset_aligned_size(header->payload_size, kDatasetPayloadAlignment);
+      if (header->magic != kDatasetRecordMagic || offset + record_size > size_) {
+        if (offset % kDatasetChunkAlignment == 0) {
+          break;  // A truncated chunk
+        }
+        offset = dataset_aligned_size(offset, kDatasetChunkAlignment);
+        continue;
+      }
+      DatasetIndexEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.ts_100us = header->ts_100us;
+      entry.offset = offset;
+      entry.type = header->type;
+      index_.push_back(entry);
+      offset += record_size;
+    }
+    std::stable_sort(index_.begin(), index_.end(),
+                     [](const DatasetIndexEntry& a, const DatasetIndexEntry& b) {
+                       return a.ts_100us < b.ts_100us;
+                     });
+  }
+
+  const uint8_t* data_;
+  size_t size_;
+  std::vector<DatasetIndexEntry> index_;
+};
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_HELPER_DATASET_FILE_H_
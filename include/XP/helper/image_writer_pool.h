@@ -0,0 +1,459 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_HELPER_IMAGE_WRITER_POOL_H_
+#define XP_INCLUDE_XP_HELPER_IMAGE_WRITER_POOL_H_
+
+/*
+ * Saves the images of a recording as PNG files with several encoder threads:
+ * - Frames are encoded in parallel, but written to disk by one writer thread in the order they
+ *   are pushed, so the files of a recording are complete up to the last written frame.
+ * - At most max_pending frames are held in memory.  Beyond that, a new frame is dropped,
+ *   blocks the producer, or is spilled to a raw file as is (a plain append, much cheaper than
+ *   encoding).  Only DROP can leave holes in a recording.
+ * - Once a frame is spilled, the following frames are spilled too until the writer thread has
+ *   read all the spilled frames back (one per written frame), so the push order holds.
+ */
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace XP {
+
+enum class ImageWriterOverflow {
+  DROP = 0,   // Drop the new frame
+  BLOCK = 1,  // Block push until a frame is written
+  SPILL = 2   // Append the new frame to the spill file, and encode it once the writer catches up
+};
+
+struct ImageWriterStats {
+  uint64_t num_pushed;    // Frames
+  uint64_t num_written;
+  uint64_t num_spilled;   // Frames that went through the spill file
+  uint64_t num_dropped;
+  uint64_t num_failed;    // Failed to encode or write
+  uint64_t bytes_written;
+  float disk_MBps;        // bytes_written over the time since the first push
+  float encode_ms;        // Average encode time of one frame (all its images)
+  float producer_wait_ms;  // Total time push is blocked by BLOCK
+};
+
+class ImageWriterPool {
+ public:
+  // Each image of a frame and the file to save it to
+  typedef std::vector<std::pair<std::string, cv::Mat>> Frame;
+
+  ImageWriterPool& operator=(const ImageWriterPool&) = delete;
+  ImageWriterPool(const ImageWriterPool& other) = delete;
+
+  // num_workers: the encoder threads
+  // max_pending: the frames queued or being encoded or written
+  // spill_path: the spill file for SPILL.  It is created on the first spill and removed once
+  //             all its frames are read back.
+  // png_compression: 0 - 9.  The default 1 gives most of the size gain of PNG at a fraction
+  //                  of the CPU time of the OpenCV default (3).
+  ImageWriterPool(const int num_workers,
+                  const size_t max_pending,
+                  const ImageWriterOverflow overflow,
+                  const std::string& spill_path = "",
+                  const int png_compression = 1) :
+      max_pending_(max_pending),
+      overflow_(overflow),
+      spill_path_(spill_path),
+      png_params_({cv::IMWRITE_PNG_COMPRESSION, png_compression}),
+      is_stopped_(false),
+      spill_file_(nullptr),
+      spill_read_file_(nullptr),
+      num_spill_pending_(0),
+      spill_broken_(false),
+      stats_() {
+    CHECK_GT(num_workers, 0);
+    CHECK_GT(max_pending, 0);
+    CHECK(overflow != ImageWriterOverflow::SPILL || !spill_path.empty());
+    for (int i = 0; i < num_workers; ++i) {
+      threads_.push_back(std::thread(&ImageWriterPool::thread_encode, this));
+    }
+    threads_.push_back(std::thread(&ImageWriterPool::thread_write, this));
+  }
+  ~ImageWriterPool() { stop(); }
+
+  // The images are referenced, not copied, so do not modify them afterwards.
+  // Return false if the frame is dropped or the pool is stopped.
+  bool push(const Frame& frame) {
+    std::unique_lock<std::mutex> lock(m_);
+    if (is_stopped_) {
+      return false;
+    }
+    if (stats_.num_pushed == 0) {
+      first_push_time_ = std::chrono::steady_clock::now();
+    }
+    ++stats_.num_pushed;
+    // Frames pushed after a spilled one are spilled too, to keep the push order
+    if (jobs_.size() >= max_pending_ || num_spill_pending_ > 0) {
+      switch (overflow_) {
+        case ImageWriterOverflow::DROP:
+          ++stats_.num_dropped;
+          return false;
+        case ImageWriterOverflow::BLOCK: {
+          const auto wait_start = std::chrono::steady_clock::now();
+          not_full_cond_.wait(lock, [this] { return jobs_.size() < max_pending_ || is_stopped_; });
+          producer_wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - wait_start).count();
+          if (is_stopped_) {
+            ++stats_.num_dropped;
+            return false;
+          }
+          break;
+        }
+        case ImageWriterOverflow::SPILL:
+          // Appended under the lock, so the spill file keeps the push order
+          if (!spill(frame)) {
+            ++stats_.num_dropped;
+            return false;
+          }
+          ++stats_.num_spilled;
+          ++num_spill_pending_;
+          return true;
+      }
+    }
+    enqueue(frame);
+    lock.unlock();
+    encode_cond_.notify_one();
+    return true;
+  }
+
+  // Write all the pushed and spilled frames, then join the threads
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      if (is_stopped_ || threads_.empty()) {
+        return;
+      }
+      is_stopped_ = true;
+    }
+    encode_cond_.notify_all();
+    write_cond_.notify_all();
+    not_full_cond_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+    threads_.clear();
+  }
+
+  ImageWriterStats get_stats() {
+    std::lock_guard<std::mutex> lock(m_);
+    ImageWriterStats stats = stats_;
+    if (stats.num_pushed > 0) {
+      const float sec = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - first_push_time_).count() * 1e-6f;
+      stats.disk_MBps = sec > 0 ? stats.bytes_written / sec / (1 << 20) : 0.f;
+    }
+    const uint64_t num_done = stats.num_written + stats.num_failed;
+    stats.encode_ms = num_done > 0 ? encode_us_ * 1e-3f / num_done : 0.f;
+    stats.producer_wait_ms = producer_wait_us_ * 1e-3f;
+    return stats;
+  }
+
+  // e.g. "pushed 1200 written 1190 spilled 35 dropped 0 failed 0 disk 12.3 MB/s
+  //       encode 41.2 ms wait(ms) 0"
+  std::string get_stats_string() {
+    const ImageWriterStats stats = get_stats();
+    std::ostringstream ss;
+    ss << "pushed " << stats.num_pushed
+       << " written " << stats.num_written
+       << " spilled " << stats.num_spilled
+       << " dropped " << stats.num_dropped
+       << " failed " << stats.num_failed
+       << " disk " << stats.disk_MBps << " MB/s"
+       << " encode " << stats.encode_ms << " ms"
+       << " wait(ms) " << stats.producer_wait_ms;
+    return ss.str();
+  }
+
+ private:
+  struct Job {
+    std::vector<std::string> paths;
+    std::vector<cv::Mat> imgs;
+    std::vector<std::vector<uchar>> encoded;
+    bool is_encoded = false;
+    bool is_ok = true;
+  };
+
+  // The caller must hold m_
+  void enqueue(const Frame& frame) {
+    std::shared_ptr<Job> job(new Job);
+    for (const auto& path_img : frame) {
+      job->paths.push_back(path_img.first);
+      job->imgs.push_back(path_img.second);
+    }
+    jobs_.push_back(job);
+    to_encode_.push_back(job);
+  }
+
+  void thread_encode() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(m_);
+        // The writer thread still refills to_encode_ from the spill file after stop()
+        encode_cond_.wait(lock, [this] {
+          return (is_stopped_ && num_spill_pending_ == 0) || !to_encode_.empty();
+        });
+        if (to_encode_.empty()) {
+          return;  // Stopped and drained
+        }
+        job = to_encode_.front();
+        to_encode_.pop_front();
+      }
+      const auto encode_start = std::chrono::steady_clock::now();
+      job->encoded.resize(job->imgs.size());
+      for (size_t i = 0; i < job->imgs.size(); ++i) {
+        if (!cv::imencode(".png", job->imgs[i], job->encoded[i], png_params_)) {
+          LOG(ERROR) << "Fail to encode " << job->paths[i];
+          job->is_ok = false;
+          break;
+        }
+      }
+      // Release the images as soon as possible, e.g., back to ImageBufferPool
+      job->imgs.clear();
+      const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - encode_start).count();
+      {
+        std::lock_guard<std::mutex> lock(m_);
+        encode_us_ += us;
+        job->is_encoded = true;
+      }
+      write_cond_.notify_one();
+    }
+  }
+
+  // Write the encoded frames in the push order
+  void thread_write() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(m_);
+        write_cond_.wait(lock, [this] {
+          return (is_stopped_ && to_encode_.empty() && jobs_.empty()) ||
+              (!jobs_.empty() && jobs_.front()->is_encoded);
+        });
+        if (jobs_.empty()) {
+          return;  // Stopped and drained
+        }
+        job = jobs_.front();
+      }
+      uint64_t bytes = 0;
+      for (size_t i = 0; i < job->encoded.size() && job->is_ok; ++i) {
+        job->is_ok = write_file(job->paths[i], job->encoded[i]);
+        bytes += job->encoded[i].size();
+      }
+      bool refill;
+      {
+        std::lock_guard<std::mutex> lock(m_);
+        jobs_.pop_front();
+        if (job->is_ok) {
+          ++stats_.num_written;
+          stats_.bytes_written += bytes;
+        } else {
+          ++stats_.num_failed;
+        }
+        refill = num_spill_pending_ > 0;
+      }
+      if (refill) {
+        // Take the freed slot for the oldest spilled frame, i.e., jobs_ stays full (and
+        // non-empty) until the spill file is drained
+        refill_from_spill();
+      }
+      not_full_cond_.notify_one();
+      // In case stop() waits for the last frame
+      write_cond_.notify_all();
+    }
+  }
+
+  static bool write_file(const std::string& path, const std::vector<uchar>& bytes) {
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+      LOG(ERROR) << "Fail to open " << path;
+      return false;
+    }
+    const bool ok = fwrite(bytes.data(), 1, bytes.size(), fp) == bytes.size();
+    if (fclose(fp) != 0 || !ok) {
+      LOG(ERROR) << "Fail to write " << path;
+      return false;
+    }
+    return true;
+  }
+
+  // Spill record: num_images, then per image: path size, path, rows, cols, type, pixels.
+  // The caller must hold m_.
+  bool spill(const Frame& frame) {
+    if (spill_broken_) {
+      // The records after a partial one can't be read back
+      return false;
+    }
+    if (spill_file_ == nullptr) {
+      spill_file_ = fopen(spill_path_.c_str(), "wb");
+      if (spill_file_ == nullptr) {
+        LOG(ERROR) << "Fail to open the spill file " << spill_path_;
+        return false;
+      }
+      setvbuf(spill_file_, nullptr, _IOFBF, 1 << 20);
+      LOG(INFO) << "The image writer falls behind. Spilling to " << spill_path_;
+    }
+    bool ok = write_pod(static_cast<uint32_t>(frame.size()));
+    for (const auto& path_img : frame) {
+      const cv::Mat& img = path_img.second;
+      ok = ok && write_pod(static_cast<uint32_t>(path_img.first.size())) &&
+          fwrite(path_img.first.data(), 1, path_img.first.size(), spill_file_) ==
+          path_img.first.size() &&
+          write_pod(static_cast<int32_t>(img.rows)) &&
+          write_pod(static_cast<int32_t>(img.cols)) &&
+          write_pod(static_cast<int32_t>(img.type()));
+      const size_t row_size = img.cols * img.elemSize();
+      for (int r = 0; r < img.rows && ok; ++r) {
+        ok = fwrite(img.ptr(r), 1, row_size, spill_file_) == row_size;
+      }
+    }
+    // Hand the whole record to the OS, where the writer thread reads it back from
+    ok = ok && fflush(spill_file_) == 0;
+    if (!ok) {
+      LOG(ERROR) << "Fail to write the spill file " << spill_path_;
+      if (num_spill_pending_ == 0) {
+        // Nothing to read back
+        fclose(spill_file_);
+        spill_file_ = nullptr;
+        remove(spill_path_.c_str());
+      } else {
+        // Drop the frames until the complete records are read back
+        spill_broken_ = true;
+      }
+    }
+    return ok;
+  }
+
+  template <typename T>
+  bool write_pod(const T& val) {
+    return fwrite(&val, sizeof(T), 1, spill_file_) == 1;
+  }
+
+  template <typename T>
+  static bool read_pod(FILE* fp, T* val) {
+    return fread(val, sizeof(T), 1, fp) == 1;
+  }
+
+  // Read the next spill record into frame
+  static bool read_spilled_frame(FILE* fp, Frame* frame) {
+    uint32_t num_images;
+    if (!read_pod(fp, &num_images)) {
+      return false;
+    }
+    frame->resize(num_images);
+    for (uint32_t i = 0; i < num_images; ++i) {
+      std::pair<std::string, cv::Mat>& path_img = (*frame)[i];
+      uint32_t path_size;
+      int32_t rows, cols, type;
+      if (!read_pod(fp, &path_size)) {
+        return false;
+      }
+      path_img.first.resize(path_size);
+      if (fread(&path_img.first[0], 1, path_size, fp) != path_size ||
+          !read_pod(fp, &rows) || !read_pod(fp, &cols) || !read_pod(fp, &type)) {
+        return false;
+      }
+      path_img.second.create(rows, cols, type);
+      const size_t size = path_img.second.total() * path_img.second.elemSize();
+      if (fread(path_img.second.data, 1, size, fp) != size) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // [Writer thread] Move the oldest spilled frame to the encode queue.  The spill file is
+  // removed once all its frames are read back, and the next spill starts a new one.
+  void refill_from_spill() {
+    if (spill_read_file_ == nullptr) {
+      spill_read_file_ = fopen(spill_path_.c_str(), "rb");
+    }
+    // Read without holding m_.  push only appends after the records counted so far.
+    Frame frame;
+    bool ok = false;
+    if (spill_read_file_ != nullptr) {
+      clearerr(spill_read_file_);
+      ok = read_spilled_frame(spill_read_file_, &frame);
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      if (ok) {
+        enqueue(frame);
+        --num_spill_pending_;
+      } else {
+        LOG(ERROR) << "Fail to read " << num_spill_pending_ << " frames back from the spill file "
+                   << spill_path_;
+        stats_.num_failed += num_spill_pending_;
+        num_spill_pending_ = 0;
+      }
+      if (num_spill_pending_ == 0) {
+        fclose(spill_file_);
+        spill_file_ = nullptr;
+        if (spill_read_file_ != nullptr) {
+          fclose(spill_read_file_);
+          spill_read_file_ = nullptr;
+        }
+        remove(spill_path_.c_str());
+        spill_broken_ = false;
+      }
+    }
+    // Also wakes up the encoders waiting for the spill file to be drained after stop()
+    encode_cond_.notify_all();
+  }
+
+  const size_t max_pending_;
+  ImageWriterOverflow overflow_;
+  const std::string spill_path_;
+  const std::vector<int> png_params_;
+  std::mutex m_;
+  std::condition_variable encode_cond_;
+  std::condition_variable write_cond_;
+  std::condition_variable not_full_cond_;
+  bool is_stopped_;
+  std::deque<std::shared_ptr<Job>> jobs_;  // In the push order, until written
+  std::deque<std::shared_ptr<Job>> to_encode_;
+  FILE* spill_file_;  // Appended by push
+  FILE* spill_read_file_;  // Only read by the writer thread
+  uint64_t num_spill_pending_;  // The spilled frames not read back yet
+  bool spill_broken_;  // A spill record is partial.  Set until the spill file is drained.
+  ImageWriterStats stats_;
+  uint64_t encode_us_ = 0;
+  uint64_t producer_wait_us_ = 0;
+  std::chrono::time_point<std::chrono::steady_clock> first_push_time_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_HELPER_IMAGE_WRITER_POOL_H_
@@ -0,0 +1,259 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_HELPER_IMU_LOG_FILE_H_
+#define XP_INCLUDE_XP_HELPER_IMU_LOG_FILE_H_
+
+/*
+ * A binary IMU log (imu_data.bin), to replace the text imu_data.txt of a recording:
+ * [header (16 bytes)] [record (32 bytes)] [record] ...
+ * The writer buffers the records and writes them with one write() per buffer, and fdatasync's
+ * the file periodically, instead of formatting and flushing every sample.  A record is never
+ * split by a crash but at the end of the file, which the reader ignores.
+ */
+
+#include <driver/basic_datatype.h>  // For XPDRIVER::ImuData
+#include <glog/logging.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace XP {
+
+constexpr char kImuLogMagic[8] = {'X', 'P', 'I', 'M', 'U', 'L', 'O', 'G'};
+constexpr uint32_t kImuLogVersion = 1;
+
+struct ImuLogHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+static_assert(sizeof(ImuLogHeader) == 16, "ImuLogHeader must be 16 bytes");
+
+// The same units as XPDRIVER::ImuData: 100 us, m/s^2 and rad/s
+struct ImuLogRecord {
+  float time_stamp;
+  float accel[3];
+  float ang_v[3];
+  uint32_t reserved;
+};
+static_assert(sizeof(ImuLogRecord) == 32, "ImuLogRecord must be 32 bytes");
+
+class ImuLogWriter {
+ public:
+  ImuLogWriter& operator=(const ImuLogWriter&) = delete;
+  ImuLogWriter(const ImuLogWriter& other) = delete;
+
+  // buffer_records: the records written with one write(), i.e., ~0.25 sec of 1 kHz imu
+  // sync_period_ms: fdatasync the file at most this often.  0 disables the periodic sync.
+  explicit ImuLogWriter(const size_t buffer_records = 256, const int sync_period_ms = 1000) :
+      buffer_records_(buffer_records),
+      sync_period_(std::chrono::milliseconds(sync_period_ms)),
+      fd_(-1) {
+    CHECK_GT(buffer_records, 0);
+    buffer_.reserve(buffer_records);
+  }
+  ~ImuLogWriter() { close(); }
+
+  bool open(const std::string& path) {
+    if (fd_ >= 0) {
+      LOG(ERROR) << "ImuLogWriter is already open";
+      return false;
+    }
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      LOG(ERROR) << "Fail to open " << path << ": " << strerror(errno);
+      return false;
+    }
+    ImuLogHeader header;
+    memcpy(header.magic, kImuLogMagic, sizeof(header.magic));
+    header.version = kImuLogVersion;
+    header.record_size = sizeof(ImuLogRecord);
+    if (!write_all(&header, sizeof(header))) {
+      close();
+      return false;
+    }
+    last_sync_time_ = std::chrono::steady_clock::now();
+    return true;
+  }
+
+  // Not thread-safe.  Call it from one thread, e.g., the imu writing thread.
+  bool add(const XPDRIVER::ImuData& imu_data) {
+    if (fd_ < 0) {
+      return false;
+    }
+    ImuLogRecord record;
+    record.time_stamp = imu_data.time_stamp;
+    memcpy(record.accel, imu_data.accel, sizeof(record.accel));
+    memcpy(record.ang_v, imu_data.ang_v, sizeof(record.ang_v));
+    record.reserved = 0;
+    buffer_.push_back(record);
+    if (buffer_.size() < buffer_records_) {
+      return true;
+    }
+    if (!flush()) {
+      return false;
+    }
+    if (sync_period_.count() > 0 &&
+        std::chrono::steady_clock::now() - last_sync_time_ >= sync_period_) {
+      return sync();
+    }
+    return true;
+  }
+
+  // Write the buffered records
+  bool flush() {
+    if (fd_ < 0) {
+      return false;
+    }
+    const bool ok = write_all(buffer_.data(), buffer_.size() * sizeof(ImuLogRecord));
+    buffer_.clear();
+    return ok;
+  }
+
+  // Write the buffered records and make them durable
+  bool sync() {
+    if (!flush()) {
+      return false;
+    }
+    last_sync_time_ = std::chrono::steady_clock::now();
+    if (fdatasync(fd_) != 0) {
+      LOG(ERROR) << "ImuLogWriter fails to sync: " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool close() {
+    if (fd_ < 0) {
+      return false;
+    }
+    const bool ok = sync();
+    ::close(fd_);
+    fd_ = -1;
+    return ok;
+  }
+
+ private:
+  bool write_all(const void* data, size_t size) {
+    const char* ptr = static_cast<const char*>(data);
+    while (size > 0) {
+      const ssize_t n = ::write(fd_, ptr, size);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG(ERROR) << "ImuLogWriter fails to write: " << strerror(errno);
+        return false;
+      }
+      ptr += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  const size_t buffer_records_;
+  const std::chrono::steady_clock::duration sync_period_;
+  int fd_;
+  std::vector<ImuLogRecord> buffer_;
+  std::chrono::time_point<std::chrono::steady_clock> last_sync_time_;
+};
+
+// Append all the samples of path to imu_samples.  A partial record at the end of the file
+// (e.g., the recorder was killed) is ignored.
+inline bool load_imu_log(const std::string& path, std::vector<XPDRIVER::ImuData>* imu_samples) {
+  CHECK_NOTNULL(imu_samples);
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs.is_open()) {
+    LOG(ERROR) << "Fail to open " << path;
+    return false;
+  }
+  ImuLogHeader header;
+  if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      memcmp(header.magic, kImuLogMagic, sizeof(header.magic)) != 0) {
+    LOG(ERROR) << path << " is not an imu log";
+    return false;
+  }
+  if (header.version != kImuLogVersion || header.record_size != sizeof(ImuLogRecord)) {
+    LOG(ERROR) << path << " has unsupported version " << header.version
+               << " record size " << header.record_size;
+    return false;
+  }
+  ifs.seekg(0, std::ios::end);
+  const size_t num_records = (static_cast<size_t>(ifs.tellg()) - sizeof(header)) /
+      sizeof(ImuLogRecord);
+  ifs.seekg(sizeof(header), std::ios::beg);
+  std::vector<ImuLogRecord> records(num_records);
+  if (!ifs.read(reinterpret_cast<char*>(records.data()), num_records * sizeof(ImuLogRecord))) {
+    LOG(ERROR) << "Fail to read " << path;
+    return false;
+  }
+  imu_samples->reserve(imu_samples->size() + num_records);
+  for (const ImuLogRecord& record : records) {
+    XPDRIVER::ImuData imu_data;
+    imu_data.time_stamp = record.time_stamp;
+    memcpy(imu_data.accel, record.accel, sizeof(imu_data.accel));
+    memcpy(imu_data.ang_v, record.ang_v, sizeof(imu_data.ang_v));
+    imu_samples->push_back(imu_data);
+  }
+  return true;
+}
+
+// Write the samples in the text format of imu_data.txt, one sample per line:
+// ts_100us accel_x accel_y accel_z ang_v_x ang_v_y ang_v_z temperature
+inline void write_imu_text_line(const XPDRIVER::ImuData& imu_data, std::ostream* os) {
+  const int temperature = 999;  // a fake value
+  *os << static_cast<uint64_t>(imu_data.time_stamp) << " "
+      << imu_data.accel[0] << " "
+      << imu_data.accel[1] << " "
+      << imu_data.accel[2] << " "
+      << imu_data.ang_v[0] << " "
+      << imu_data.ang_v[1] << " "
+      << imu_data.ang_v[2] << " "
+      << temperature << "\n";
+}
+
+// Convert an imu log (imu_data.bin) to imu_data.txt
+inline bool convert_imu_log_to_text(const std::string& bin_path, const std::string& txt_path) {
+  std::vector<XPDRIVER::ImuData> imu_samples;
+  if (!load_imu_log(bin_path, &imu_samples)) {
+    return false;
+  }
+  std::ofstream ofs(txt_path, std::ios::trunc);
+  if (!ofs.is_open()) {
+    LOG(ERROR) << "Fail to open " << txt_path;
+    return false;
+  }
+  for (const XPDRIVER::ImuData& imu_data : imu_samples) {
+    write_imu_text_line(imu_data, &ofs);
+  }
+  ofs.close();
+  if (!ofs) {
+    LOG(ERROR) << "Fail to write " << txt_path;
+    return false;
+  }
+  LOG(INFO) << "Converted " << imu_samples.size() << " imu samples to " << txt_path;
+  return true;
+}
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_HELPER_IMU_LOG_FILE_H_
@@ -17,8 +17,10 @@
 #define XP_INCLUDE_XP_HELPER_SHARED_QUEUE_H_
 
 #include <glog/logging.h>
+#include <chrono>
 #include <deque>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <condition_variable>
@@ -49,6 +51,24 @@ void pop_to_back(OtherContainer* container, T* elem) {
 }
 }  // namespace internal
 
+// What push_back does when the queue already holds capacity elements (see set_capacity)
+enum class OverflowPolicy {
+  BLOCK_PRODUCER = 0,  // Wait until the consumer pops an element
+  DROP_OLDEST = 1,     // Drop the front element to make room for the new one
+  DROP_NEWEST = 2,     // Drop the new element
+  KEEP_LATEST = 3      // Drop everything and only keep the new element
+};
+
+struct SharedQueueStats {
+  size_t size;
+  size_t capacity;          // 0 means unbounded
+  size_t high_water_mark;   // The max size ever reached
+  uint64_t total_pushed;
+  uint64_t total_dropped;   // Dropped by the overflow policy, push_back_with_cap or pop_to_back
+  float producer_wait_ms;   // Total time push_back is blocked by BLOCK_PRODUCER
+  float consumer_wait_ms;   // Total time wait_and_* waits on an empty queue
+};
+
 template <typename T, typename Container = std::deque<T> >
 class shared_queue {
  public:
@@ -56,7 +76,12 @@ class shared_queue {
   shared_queue& operator=(const shared_queue&) = delete;
   shared_queue(const shared_queue& other) = delete;
 
-  explicit shared_queue(const std::string& name) : name_(name), kill_(false) {}
+  explicit shared_queue(const std::string& name,
+                        size_t capacity = 0,
+                        OverflowPolicy policy = OverflowPolicy::BLOCK_PRODUCER) :
+      name_(name), kill_(false), capacity_(capacity), policy_(policy),
+      high_water_mark_(0), total_pushed_(0), total_dropped_(0),
+      producer_wait_us_(0), consumer_wait_us_(0) {}
   ~shared_queue() {
     // make sure you always call kill before destruction
     if (!kill_ && !queue_.empty()) {
@@ -64,11 +89,25 @@ class shared_queue {
     }
   }
 
+  // Bound the queue to capacity elements.  0 means unbounded (the default).
+  void set_capacity(size_t capacity, OverflowPolicy policy) {
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      capacity_ = capacity;
+      policy_ = policy;
+    }
+    not_full_cond_.notify_all();
+  }
+
   // Use this function to kill the shared_queue before the application exists
   // to prevent potential deadlock.
   void kill() {
-    kill_ = true;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      kill_ = true;
+    }
     cond_.notify_all();  // Notify all for all potential subscribers to stop waiting
+    not_full_cond_.notify_all();  // and all the blocked producers
   }
 
   // Use this function to "re-initialize" the shared queue
@@ -84,13 +123,45 @@ class shared_queue {
     return queue_.front();
   }
 
-  void push_back(T elem) {
+  // Return false if elem is dropped (DROP_NEWEST) or the queue is killed while blocking
+  bool push_back(T elem) {
     {
-      std::lock_guard<std::mutex> lock(m_);
+      std::unique_lock<std::mutex> lock(m_);
+      if (capacity_ > 0 && queue_.size() >= capacity_) {
+        switch (policy_) {
+          case OverflowPolicy::BLOCK_PRODUCER: {
+            const auto wait_start = std::chrono::steady_clock::now();
+            not_full_cond_.wait(lock, [this]() {
+              return capacity_ == 0 || queue_.size() < capacity_ || kill_;
+            });
+            producer_wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - wait_start).count();
+            if (kill_) {
+              return false;
+            }
+            break;
+          }
+          case OverflowPolicy::DROP_OLDEST:
+            while (queue_.size() >= capacity_) {
+              queue_.pop_front();
+              ++total_dropped_;
+            }
+            break;
+          case OverflowPolicy::DROP_NEWEST:
+            ++total_dropped_;
+            return false;
+          case OverflowPolicy::KEEP_LATEST:
+            total_dropped_ += queue_.size();
+            queue_.clear();
+            break;
+        }
+      }
       queue_.push_back(std::move(elem));
+      on_pushed();
     }
     // Unlock mutex m_ before notifying
     cond_.notify_one();
+    return true;
   }
 
   // queue_ will push_back this elem and then pop_front until the cap_num is met.
@@ -98,8 +169,10 @@ class shared_queue {
     {
       std::lock_guard<std::mutex> lock(m_);
       queue_.push_back(std::move(elem));
+      on_pushed();
       while (queue_.size() > cap_num) {
         queue_.pop_front();
+        ++total_dropped_;
       }
     }
     // Unlock mutex m_ before notifying
@@ -107,55 +180,79 @@ class shared_queue {
   }
 
   void pop_front() {
-    std::lock_guard<std::mutex> lock(m_);
-    if (!queue_.empty()) {
-      queue_.pop_front();
+    bool producers_may_wait;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      if (!queue_.empty()) {
+        queue_.pop_front();
+      }
+      producers_may_wait = may_block_producer();
     }
+    notify_not_full(producers_may_wait, false);
   }
 
   void pop_to_back(T* elem) {
-    std::lock_guard<std::mutex> lock(m_);
-    internal::pop_to_back(&queue_, elem);
+    bool producers_may_wait;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      total_dropped_ += queue_.size() - 1;
+      internal::pop_to_back(&queue_, elem);
+      producers_may_wait = may_block_producer();
+    }
+    notify_not_full(producers_may_wait, true);
   }
 
   bool wait_and_pop_front(T* elem) {
-    std::unique_lock<std::mutex> lock(m_);
-    cond_.wait(lock, [this](){return !queue_.empty() || kill_; });
-    if (kill_) {
-      return false;
-    } else {
+    bool producers_may_wait;
+    {
+      std::unique_lock<std::mutex> lock(m_);
+      wait_not_empty(&lock);
+      if (kill_) {
+        return false;
+      }
       *elem = std::move(queue_.front());
       queue_.pop_front();
-      return true;
+      producers_may_wait = may_block_producer();
     }
+    notify_not_full(producers_may_wait, false);
+    return true;
   }
 
   bool wait_and_pop_to_back(T* elem) {
-    std::unique_lock<std::mutex> lock(m_);
-    cond_.wait(lock, [this](){ return !queue_.empty() || kill_; });
-    if (kill_) {
-      return false;
-    } else {
+    bool producers_may_wait;
+    {
+      std::unique_lock<std::mutex> lock(m_);
+      wait_not_empty(&lock);
+      if (kill_) {
+        return false;
+      }
+      total_dropped_ += queue_.size() - 1;
       internal::pop_to_back(&queue_, elem);
-      return true;
+      producers_may_wait = may_block_producer();
     }
+    notify_not_full(producers_may_wait, true);
+    return true;
   }
 
   bool wait_and_pop_all(std::vector<T>* elem_vec) {
-    std::unique_lock<std::mutex> lock(m_);
-    cond_.wait(lock, [this](){ return !queue_.empty() || kill_; });
-    if (kill_) {
-      return false;
-    } else {
+    bool producers_may_wait;
+    {
+      std::unique_lock<std::mutex> lock(m_);
+      wait_not_empty(&lock);
+      if (kill_) {
+        return false;
+      }
       elem_vec->assign(queue_.begin(), queue_.end());
       queue_.clear();
-      return true;
+      producers_may_wait = may_block_producer();
     }
+    notify_not_full(producers_may_wait, true);
+    return true;
   }
 
   bool wait_and_peek_front(T* elem) {
     std::unique_lock<std::mutex> lock(m_);
-    cond_.wait(lock, [this](){ return !queue_.empty() || kill_; });
+    wait_not_empty(&lock);
     if (kill_) {
       return false;
     } else {
@@ -175,16 +272,91 @@ class shared_queue {
   }
 
   void clear() {
+    bool producers_may_wait;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      queue_.clear();
+      producers_may_wait = may_block_producer();
+    }
+    notify_not_full(producers_may_wait, true);
+  }
+
+  SharedQueueStats get_stats() {
     std::lock_guard<std::mutex> lock(m_);
-    queue_.clear();
+    SharedQueueStats stats;
+    stats.size = queue_.size();
+    stats.capacity = capacity_;
+    stats.high_water_mark = high_water_mark_;
+    stats.total_pushed = total_pushed_;
+    stats.total_dropped = total_dropped_;
+    stats.producer_wait_ms = producer_wait_us_ * 1e-3f;
+    stats.consumer_wait_ms = consumer_wait_us_ * 1e-3f;
+    return stats;
+  }
+
+  // e.g. "stereo_image_queue size 2/10 max 10 pushed 1200 dropped 35 wait(ms) p 0 c 3412.5"
+  std::string get_stats_string() {
+    const SharedQueueStats stats = get_stats();
+    std::ostringstream ss;
+    ss << name_ << " size " << stats.size << "/" << stats.capacity
+       << " max " << stats.high_water_mark
+       << " pushed " << stats.total_pushed
+       << " dropped " << stats.total_dropped
+       << " wait(ms) p " << stats.producer_wait_ms << " c " << stats.consumer_wait_ms;
+    return ss.str();
   }
 
  private:
+  // The caller must hold m_
+  void on_pushed() {
+    ++total_pushed_;
+    if (queue_.size() > high_water_mark_) {
+      high_water_mark_ = queue_.size();
+    }
+  }
+
+  // The caller must hold m_ via lock
+  void wait_not_empty(std::unique_lock<std::mutex>* lock) {
+    if (!queue_.empty() || kill_) {
+      return;
+    }
+    const auto wait_start = std::chrono::steady_clock::now();
+    cond_.wait(*lock, [this](){ return !queue_.empty() || kill_; });
+    consumer_wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - wait_start).count();
+  }
+
+  // The caller must hold m_.  Only producers blocked by BLOCK_PRODUCER wait on not_full_cond_.
+  bool may_block_producer() const {
+    return capacity_ > 0 && policy_ == OverflowPolicy::BLOCK_PRODUCER;
+  }
+
+  // Call it after unlocking m_, with producers_may_wait = may_block_producer() read under m_.
+  // Wake all the blocked producers if more than one slot may have been freed.
+  void notify_not_full(const bool producers_may_wait, const bool freed_many) {
+    if (!producers_may_wait) {
+      return;
+    }
+    if (freed_many) {
+      not_full_cond_.notify_all();
+    } else {
+      not_full_cond_.notify_one();
+    }
+  }
+
   Container queue_;
   std::mutex m_;
   std::condition_variable cond_;
+  std::condition_variable not_full_cond_;
   std::string name_;
   bool kill_;
+  size_t capacity_;
+  OverflowPolicy policy_;
+  size_t high_water_mark_;
+  uint64_t total_pushed_;
+  uint64_t total_dropped_;
+  uint64_t producer_wait_us_;
+  uint64_t consumer_wait_us_;
 };
 }  // namespace XP
 #endif  // XP_INCLUDE_XP_HELPER_SHARED_QUEUE_H_
@@ -0,0 +1,27 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_HELPER_SPSC_QUEUE_H_
+#define XP_INCLUDE_XP_HELPER_SPSC_QUEUE_H_
+
+// The lock-free single-producer / single-consumer queue is shared with the driver.
+// Use it in place of XP::shared_queue when exactly one thread pushes and one thread pops,
+// e.g. the imu data queue fed by the driver imu callback.
+#include <driver/helper/spsc_queue.h>
+
+namespace XP {
+using XPDRIVER::spsc_queue;
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_HELPER_SPSC_QUEUE_H_
@@ -17,6 +17,8 @@
 #define XP_INCLUDE_XP_UTIL_FEATURE_UTILS_H_
 
 #include <XP/helper/param.h>
+#include <XP/util/pyramid_kernels.h>
+#include <XP/util/pyramid_set.h>
 #include <glog/logging.h>
 #include <opencv2/video/tracking.hpp>
 
@@ -222,6 +224,39 @@ class FeatureTrackDetector {
     BUILD_TO_PREV = 1
   };
   void build_img_pyramids(const cv::Mat& img_in_smooth, int build_type = BUILD_TO_CURR);
+  // Use the left pyramids of the shared frame pyramids instead of building them again.
+  // The levels are copied into the pyramids buffer of this detector, which
+  // build_img_pyramids and the optical flow write into, so the set stays read-only.
+  // The buffer is reused if it already holds the levels one after another (as copied here).
+  void set_img_pyramids(const PyramidSet& pyramids, int build_type = BUILD_TO_CURR) {
+    CHECK_GE(pyramids.levels(), kMaxPyraLevelOF);
+    const std::vector<cv::Mat>& img_pyramids = pyramids.img_pyramids(PyramidSet::LEFT);
+    std::vector<cv::Mat>& dst_pyramids =
+        build_type == BUILD_TO_CURR ? curr_img_pyramids_ : prev_img_pyramids_;
+    std::shared_ptr<uchar>& buffer =
+        build_type == BUILD_TO_CURR ? curr_pyramids_buffer_ : prev_pyramids_buffer_;
+    bool reuse_buffer = buffer && buffer.use_count() == 1 &&
+        dst_pyramids.size() == static_cast<size_t>(kMaxPyraLevelOF);
+    size_t buffer_bytes = 0;
+    for (int l = 0; l < kMaxPyraLevelOF; ++l) {
+      if (reuse_buffer && (dst_pyramids[l].data != buffer.get() + buffer_bytes ||
+                           dst_pyramids[l].type() != CV_8U ||
+                           dst_pyramids[l].size() != img_pyramids[l].size())) {
+        reuse_buffer = false;
+      }
+      buffer_bytes += img_pyramids[l].total();
+    }
+    if (!reuse_buffer) {
+      buffer.reset(new uchar[buffer_bytes], std::default_delete<uchar[]>());
+      dst_pyramids.resize(kMaxPyraLevelOF);
+    }
+    uchar* level_ptr = buffer.get();
+    for (int l = 0; l < kMaxPyraLevelOF; ++l) {
+      dst_pyramids[l] = cv::Mat(img_pyramids[l].size(), CV_8U, level_ptr);
+      img_pyramids[l].copyTo(dst_pyramids[l]);
+      level_ptr += img_pyramids[l].total();
+    }
+  }
   void set_mask_with_of_out(const cv::Mat_<uchar>& mask_with_of_out) {
     mask_with_of_out_ = mask_with_of_out.clone();
   }
@@ -303,6 +338,20 @@ class ImgFeaturePropagator {
                          std::vector<cv::KeyPoint>* cur_keypoints,
                          cv::Mat* cur_orb_features = nullptr,
                          const bool draw_debug = false);
+  // Propagate from the shared pyramids of the reference (key)frame, see pyramid_set.h
+  bool PropagateFeatures(const cv::Mat& cur_img,
+                         const PyramidSet& ref_pyramids,
+                         int ref_lr,
+                         const std::vector<cv::KeyPoint>& ref_keypoints,
+                         const Eigen::Matrix4f& T_ref_cur,
+                         const bool use_pyra_direct_matcher,
+                         std::vector<cv::KeyPoint>* cur_keypoints,
+                         cv::Mat* cur_orb_features = nullptr,
+                         const bool draw_debug = false) {
+    return PropagateFeatures(cur_img, ref_pyramids.img_pyramids(ref_lr), ref_keypoints,
+                             T_ref_cur, use_pyra_direct_matcher, cur_keypoints,
+                             cur_orb_features, draw_debug);
+  }
 
  private:
   ImgFeaturePropagatorImpl* impl_;
@@ -327,8 +376,30 @@ bool detect_orb_features(const std::vector<cv::Mat>& img_pyramids,
                          FeatureTrackDetector* feat_track_detector = nullptr,
                          float refine_harris_threshold = -1.f);
 
+// Detect on the shared pyramids of one image of a frame (see pyramid_set.h) with its camera
+// mask pyramids
+inline bool detect_orb_features(const PyramidSet& pyramids,
+                                int lr,
+                                int request_feat_num,
+                                int det_pyra_level,  // The specific pyramid level to do detection
+                                int fast_thresh,
+                                bool use_fast,  // or TomasShi
+                                int enforce_uniformity_radius,  // less than 5: no enforcement
+                                std::vector<cv::KeyPoint>* key_pnts_ptr,
+                                cv::Mat* orb_feat_ptr,
+                                FeatureTrackDetector* feat_track_detector = nullptr,
+                                float refine_harris_threshold = -1.f) {
+  CHECK_LT(det_pyra_level, pyramids.levels());
+  return detect_orb_features(pyramids.img_pyramids(lr), pyramids.mask_pyramids(lr),
+                             request_feat_num, det_pyra_level, fast_thresh, use_fast,
+                             enforce_uniformity_radius, key_pnts_ptr, orb_feat_ptr,
+                             feat_track_detector, refine_harris_threshold);
+}
+
 // This is the OLD interface to do feature detection with an input raw image, and
 // internally compute the image pyramids and then call the NEW interface above.
+// [NOTE] If the image is also tracked or mapped, build its PyramidSet once and use the
+//        PyramidSet interface above instead.
 bool detect_orb_features(const cv::Mat& img_in_raw,
                          const cv::Mat_<uchar>& mask,
                          int request_feat_num,
@@ -374,30 +445,14 @@ void propagate_with_optical_flow(const std::vector<cv::Mat>& img_in_smooth_pyram
                                  const cv::Matx33f* old_R_new_ptr,
                                  const bool absolute_static);
 
+// The truncated average of every 2x2 block.  SIMD, see pyramid_kernels.h.
 inline cv::Mat fast_pyra_down_original(const cv::Mat& img_in_smooth) {
   constexpr int compress_ratio = 2;
   cv::Mat img_in_small(img_in_smooth.rows / compress_ratio,
                        img_in_smooth.cols / compress_ratio,
                        CV_8U);
-#ifndef __FEATURE_UTILS_NO_DEBUG__
-  CHECK_EQ(img_in_smooth.type(), CV_8U);
-#endif
   // use our own pyra down for faster performance
-  const int width_step_in = img_in_smooth.step1();
-  const int width_step_small = img_in_small.step1();
-  for (int y = 0; y < img_in_small.rows; y++) {
-    for (int x = 0; x < img_in_small.cols; x++) {
-      // do not use .at<char> which is slow
-      const int shift0 = (y * compress_ratio) * width_step_in + x * compress_ratio;
-      const int shift1 = shift0 + width_step_in;
-      int sum =
-          static_cast<int>(*(img_in_smooth.data + shift0)) +
-          static_cast<int>(*(img_in_smooth.data + shift1)) +
-          static_cast<int>(*(img_in_smooth.data + shift0 + 1)) +
-          static_cast<int>(*(img_in_smooth.data + shift1 + 1));
-      *(img_in_small.data + y * width_step_small + x) = static_cast<uchar>(sum / 4);
-    }
-  }
+  pyra_down_to(pyra_down_kernels().pyra_down_row, img_in_smooth, &img_in_small);
   return img_in_small;
 }
 
@@ -407,27 +462,8 @@ inline cv::Mat fast_mask_pyra_down(const cv::Mat& mask) {
   cv::Mat mask_small(mask.rows / compress_ratio,
                      mask.cols / compress_ratio,
                      CV_8U);
-#ifndef __FEATURE_UTILS_NO_DEBUG__
-  CHECK_EQ(mask.type(), CV_8U);
-#endif
   // use our own pyra down for faster performance
-  const int width_step_in = mask.step1();
-  const int width_step_small = mask_small.step1();
-  for (int y = 0; y < mask_small.rows; y++) {
-    for (int x = 0; x < mask_small.cols; x++) {
-      // do not use .at<char> which is slow
-      const int shift0 = (y * compress_ratio) * width_step_in + x * compress_ratio;
-      const int shift1 = shift0 + width_step_in;
-      if (*(mask.data + shift0) == 0x00 ||
-          *(mask.data + shift1) == 0x00 ||
-          *(mask.data + shift0 + 1) == 0x00 ||
-          *(mask.data + shift1 + 1) == 0x00) {
-        *(mask_small.data + y * width_step_small + x) = 0x00;
-      } else {
-        *(mask_small.data + y * width_step_small + x) = 0xff;
-      }
-    }
-  }
+  pyra_down_to(pyra_down_kernels().mask_pyra_down_row, mask, &mask_small);
   return mask_small;
 }
 
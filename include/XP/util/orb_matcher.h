@@ -0,0 +1,215 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_UTIL_ORB_MATCHER_H_
+#define XP_INCLUDE_XP_UTIL_ORB_MATCHER_H_
+
+/*
+ * A brute-force Hamming distance matcher of 32-byte ORB descriptors, to replace
+ * cv::BFMatcher(cv::NORM_HAMMING).match.  The distances of one query to all the train
+ * descriptors are computed by SIMD popcount kernels, which all return exactly the same
+ * distances (apps/orb_matcher_benchmark checks them against the scalar kernel).
+ */
+
+#include <driver/helper/cpu_features.h>
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef XP_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+#ifdef XP_HAS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace XP {
+
+constexpr int kOrbDescBytes = 32;
+
+// dists[i] = the Hamming distance between query and train + i * kOrbDescBytes, i < num_train
+typedef void (*HammingDistsFunc)(const uint8_t* query, const uint8_t* train, int num_train,
+                                 int* dists);
+
+inline int hamming_distance_scalar(const uint8_t* a, const uint8_t* b) {
+  int dist = 0;
+  for (int i = 0; i < kOrbDescBytes; i += 8) {
+    uint64_t a64, b64;
+    memcpy(&a64, a + i, sizeof(a64));
+    memcpy(&b64, b + i, sizeof(b64));
+    dist += __builtin_popcountll(a64 ^ b64);
+  }
+  return dist;
+}
+
+inline void hamming_dists_scalar(const uint8_t* query, const uint8_t* train, int num_train,
+                                 int* dists) {
+  for (int i = 0; i < num_train; ++i) {
+    dists[i] = hamming_distance_scalar(query, train + i * kOrbDescBytes);
+  }
+}
+
+#ifdef XP_HAS_X86_SIMD
+// The popcount of every byte by looking up the 2 nibbles with pshufb
+XP_TARGET_SSE41
+inline __m128i popcount_bytes_sse41(__m128i v) {
+  const __m128i lut = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+  return _mm_add_epi8(_mm_shuffle_epi8(lut, _mm_and_si128(v, low_nibbles)),
+                      _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), low_nibbles)));
+}
+
+XP_TARGET_SSE41
+inline void hamming_dists_sse41(const uint8_t* query, const uint8_t* train, int num_train,
+                                int* dists) {
+  const __m128i q0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query));
+  const __m128i q1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query + 16));
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < num_train; ++i) {
+    const uint8_t* t = train + i * kOrbDescBytes;
+    const __m128i c0 = popcount_bytes_sse41(
+        _mm_xor_si128(q0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(t))));
+    const __m128i c1 = popcount_bytes_sse41(
+        _mm_xor_si128(q1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(t + 16))));
+    // Byte counts <= 8, so the sum of both halves still fits in a byte
+    const __m128i sum = _mm_sad_epu8(_mm_add_epi8(c0, c1), zero);
+    dists[i] = _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2);
+  }
+}
+
+// The popcount of q ^ t in 4 x 64-bit partial sums (each <= 64)
+XP_TARGET_AVX2
+inline __m256i hamming_partial_sums_avx2(__m256i q, const uint8_t* t) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  const __m256i x = _mm256_xor_si256(q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t)));
+  const __m256i counts = _mm256_add_epi8(
+      _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low_nibbles)),
+      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_nibbles)));
+  return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+XP_TARGET_AVX2
+inline void hamming_dists_avx2(const uint8_t* query, const uint8_t* train, int num_train,
+                               int* dists) {
+  const __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query));
+  int i = 0;
+  for (; i + 4 <= num_train; i += 4) {
+    // Pack the partial sums of 4 descriptors in the 4 x 16 bits of each 64-bit lane, so that
+    // one horizontal add gives the 4 distances
+    const __m256i s0 = hamming_partial_sums_avx2(q, train + i * kOrbDescBytes);
+    const __m256i s1 = hamming_partial_sums_avx2(q, train + (i + 1) * kOrbDescBytes);
+    const __m256i s2 = hamming_partial_sums_avx2(q, train + (i + 2) * kOrbDescBytes);
+    const __m256i s3 = hamming_partial_sums_avx2(q, train + (i + 3) * kOrbDescBytes);
+    const __m256i packed = _mm256_or_si256(
+        _mm256_or_si256(s0, _mm256_slli_epi64(s1, 16)),
+        _mm256_or_si256(_mm256_slli_epi64(s2, 32), _mm256_slli_epi64(s3, 48)));
+    const __m128i sum2 = _mm_add_epi16(_mm256_castsi256_si128(packed),
+                                       _mm256_extracti128_si256(packed, 1));
+    const __m128i sum = _mm_add_epi16(sum2, _mm_unpackhi_epi64(sum2, sum2));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dists + i), _mm_cvtepu16_epi32(sum));
+  }
+  for (; i < num_train; ++i) {
+    const __m256i s = hamming_partial_sums_avx2(q, train + i * kOrbDescBytes);
+    const __m128i sum2 = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    dists[i] = _mm_cvtsi128_si32(_mm_add_epi64(sum2, _mm_unpackhi_epi64(sum2, sum2)));
+  }
+}
+#endif  // XP_HAS_X86_SIMD
+
+#ifdef XP_HAS_NEON
+inline void hamming_dists_neon(const uint8_t* query, const uint8_t* train, int num_train,
+                               int* dists) {
+  const uint8x16_t q0 = vld1q_u8(query);
+  const uint8x16_t q1 = vld1q_u8(query + 16);
+  for (int i = 0; i < num_train; ++i) {
+    const uint8_t* t = train + i * kOrbDescBytes;
+    // Byte counts <= 8, so the sum of both halves still fits in a byte
+    const uint8x16_t counts = vaddq_u8(vcntq_u8(veorq_u8(q0, vld1q_u8(t))),
+                                       vcntq_u8(veorq_u8(q1, vld1q_u8(t + 16))));
+    const uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(counts)));
+    dists[i] = static_cast<int>(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+  }
+}
+#endif  // XP_HAS_NEON
+
+inline HammingDistsFunc select_hamming_dists(XPDRIVER::SimdIsa isa) {
+  switch (isa) {
+#ifdef XP_HAS_X86_SIMD
+    case XPDRIVER::SimdIsa::AVX2:
+      return hamming_dists_avx2;
+    case XPDRIVER::SimdIsa::SSE4_1:
+      return hamming_dists_sse41;
+#endif
+#ifdef XP_HAS_NEON
+    case XPDRIVER::SimdIsa::NEON:
+      return hamming_dists_neon;
+#endif
+    default:
+      return hamming_dists_scalar;
+  }
+}
+
+// The kernel of the running CPU, selected once
+inline HammingDistsFunc hamming_dists() {
+  static const HammingDistsFunc func = select_hamming_dists(XPDRIVER::detect_simd_isa());
+  return func;
+}
+
+// [NOTE] Not thread-safe.  The distance buffer is reused across calls, so use one matcher
+//        per thread.
+class OrbMatcher {
+ public:
+  explicit OrbMatcher(HammingDistsFunc dists_func = hamming_dists()) :
+      dists_func_(dists_func) {}
+
+  // Match every query descriptor to its nearest train descriptor, the first one on ties, as
+  // cv::BFMatcher::match.  matches: one per query descriptor, or none if train_desc is empty.
+  void match(const cv::Mat& query_desc,
+             const cv::Mat& train_desc,
+             std::vector<cv::DMatch>* matches) {
+    CHECK_NOTNULL(matches);
+    check_desc(query_desc);
+    check_desc(train_desc);
+    matches->clear();
+    if (train_desc.empty()) {
+      return;
+    }
+    dists_.resize(train_desc.rows);
+    matches->reserve(query_desc.rows);
+    for (int q = 0; q < query_desc.rows; ++q) {
+      dists_func_(query_desc.ptr<uint8_t>(q), train_desc.ptr<uint8_t>(), train_desc.rows,
+                  dists_.data());
+      const int t = static_cast<int>(std::min_element(dists_.begin(), dists_.end()) -
+                                     dists_.begin());
+      matches->push_back(cv::DMatch(q, t, static_cast<float>(dists_[t])));
+    }
+  }
+
+ private:
+  static void check_desc(const cv::Mat& desc) {
+    CHECK(desc.empty() || (desc.type() == CV_8U && desc.cols == kOrbDescBytes &&
+                           desc.isContinuous())) << "Not continuous 32-byte descriptors";
+  }
+
+  const HammingDistsFunc dists_func_;
+  std::vector<int> dists_;
+};
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_UTIL_ORB_MATCHER_H_
@@ -0,0 +1,408 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_UTIL_PATCH_MATCH_KERNELS_H_
+#define XP_INCLUDE_XP_UTIL_PATCH_MATCH_KERNELS_H_
+
+/*
+ * Weighted SSD of a master patch against slave image patches, the block matching cost of
+ * SlaveImgFeatureDetector:
+ *   sum over the block of weight * (master - slave)^2
+ * The master patch and the weights are int16 arrays of block_size x block_size, prepared once
+ * per keypoint, and the slave patch is read from the image.  The weights are quantized to
+ * [0, kMaxPatchWeight], so that weight * (master - slave) fits in int16, and the cost of a
+ * block up to kMaxPatchBlockSize fits in int32.  Every variant returns exactly the same cost,
+ * which apps/patch_match_benchmark checks on random or recorded rectified images.
+ */
+
+#include <driver/helper/cpu_features.h>
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#ifdef XP_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+#ifdef XP_HAS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace XP {
+
+constexpr int kMaxPatchWeight = 128;
+constexpr int kMaxPatchBlockSize = 16;
+
+// block_size: a multiple of 4, up to kMaxPatchBlockSize
+typedef int32_t (*PatchSsdFunc)(const int16_t* master_patch, const int16_t* weights,
+                                const uint8_t* slave, int slave_step, int block_size);
+
+inline int32_t patch_ssd_scalar(const int16_t* master_patch, const int16_t* weights,
+                                const uint8_t* slave, int slave_step, int block_size) {
+  int32_t ssd = 0;
+  for (int y = 0; y < block_size; ++y) {
+    const uint8_t* slave_row = slave + y * slave_step;
+    for (int x = 0; x < block_size; ++x) {
+      const int32_t diff = master_patch[x] - slave_row[x];
+      ssd += weights[x] * diff * diff;
+    }
+    master_patch += block_size;
+    weights += block_size;
+  }
+  return ssd;
+}
+
+#ifdef XP_HAS_X86_SIMD
+XP_TARGET_SSE41
+inline int32_t patch_ssd_sse41(const int16_t* master_patch, const int16_t* weights,
+                               const uint8_t* slave, int slave_step, int block_size) {
+  // madd(weight * diff, diff) sums 2 adjacent weighted squares into int32
+  __m128i acc = _mm_setzero_si128();
+  for (int y = 0; y < block_size; ++y) {
+    const uint8_t* slave_row = slave + y * slave_step;
+    int x = 0;
+    for (; x + 8 <= block_size; x += 8) {
+      const __m128i s = _mm_cvtepu8_epi16(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(slave_row + x)));
+      const __m128i d = _mm_sub_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(master_patch + x)), s);
+      const __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + x));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_mullo_epi16(d, w), d));
+    }
+    if (x < block_size) {
+      // The last 4 pixels.  The upper 4 lanes are 0.
+      int32_t s4;
+      memcpy(&s4, slave_row + x, sizeof(s4));
+      const __m128i s = _mm_cvtepu8_epi16(_mm_cvtsi32_si128(s4));
+      const __m128i d = _mm_sub_epi16(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(master_patch + x)), s);
+      const __m128i w = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(weights + x));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_mullo_epi16(d, w), d));
+    }
+    master_patch += block_size;
+    weights += block_size;
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(acc);
+}
+
+XP_TARGET_AVX2
+inline int32_t patch_ssd_avx2(const int16_t* master_patch, const int16_t* weights,
+                              const uint8_t* slave, int slave_step, int block_size) {
+  // 16 pixels of a row, or 8 pixels of 2 rows (block_size is even) per instruction
+  __m256i acc = _mm256_setzero_si256();
+  __m128i acc4 = _mm_setzero_si128();
+  for (int y = 0; y < block_size; y += 2) {
+    const uint8_t* slave_row0 = slave + y * slave_step;
+    const uint8_t* slave_row1 = slave_row0 + slave_step;
+    const int16_t* master_row1 = master_patch + block_size;
+    const int16_t* weights_row1 = weights + block_size;
+    int x = 0;
+    for (; x + 16 <= block_size; x += 16) {
+      const __m256i s0 = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(slave_row0 + x)));
+      const __m256i s1 = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(slave_row1 + x)));
+      const __m256i d0 = _mm256_sub_epi16(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(master_patch + x)), s0);
+      const __m256i d1 = _mm256_sub_epi16(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(master_row1 + x)), s1);
+      const __m256i w0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + x));
+      const __m256i w1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights_row1 + x));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_mullo_epi16(d0, w0), d0));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_mullo_epi16(d1, w1), d1));
+    }
+    if (x + 8 <= block_size) {
+      const __m256i s = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(slave_row0 + x)),
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(slave_row1 + x))));
+      const __m256i m = _mm256_inserti128_si256(_mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(master_patch + x))),
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(master_row1 + x)), 1);
+      const __m256i w = _mm256_inserti128_si256(_mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + x))),
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights_row1 + x)), 1);
+      const __m256i d = _mm256_sub_epi16(m, s);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_mullo_epi16(d, w), d));
+      x += 8;
+    }
+    if (x < block_size) {
+      int32_t s0, s1;
+      memcpy(&s0, slave_row0 + x, sizeof(s0));
+      memcpy(&s1, slave_row1 + x, sizeof(s1));
+      const __m128i s = _mm_cvtepu8_epi16(_mm_unpacklo_epi32(_mm_cvtsi32_si128(s0),
+                                                             _mm_cvtsi32_si128(s1)));
+      const __m128i m = _mm_unpacklo_epi64(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(master_patch + x)),
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(master_row1 + x)));
+      const __m128i w = _mm_unpacklo_epi64(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(weights + x)),
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(weights_row1 + x)));
+      const __m128i d = _mm_sub_epi16(m, s);
+      acc4 = _mm_add_epi32(acc4, _mm_madd_epi16(_mm_mullo_epi16(d, w), d));
+    }
+    master_patch += 2 * block_size;
+    weights += 2 * block_size;
+  }
+  __m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                 _mm256_extracti128_si256(acc, 1));
+  acc128 = _mm_add_epi32(acc128, acc4);
+  acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(acc128);
+}
+#endif  // XP_HAS_X86_SIMD
+
+#ifdef XP_HAS_NEON
+inline int32_t patch_ssd_neon(const int16_t* master_patch, const int16_t* weights,
+                              const uint8_t* slave, int slave_step, int block_size) {
+  int32x4_t acc = vdupq_n_s32(0);
+  for (int y = 0; y < block_size; ++y) {
+    const uint8_t* slave_row = slave + y * slave_step;
+    int x = 0;
+    for (; x + 8 <= block_size; x += 8) {
+      const int16x8_t s = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(slave_row + x)));
+      const int16x8_t d = vsubq_s16(vld1q_s16(master_patch + x), s);
+      const int16x8_t wd = vmulq_s16(d, vld1q_s16(weights + x));
+      acc = vmlal_s16(acc, vget_low_s16(wd), vget_low_s16(d));
+      acc = vmlal_s16(acc, vget_high_s16(wd), vget_high_s16(d));
+    }
+    if (x < block_size) {
+      // The last 4 pixels, loaded as one 32-bit lane not to read past the patch
+      uint32_t s4;
+      memcpy(&s4, slave_row + x, sizeof(s4));
+      const int16x4_t s = vget_low_s16(vreinterpretq_s16_u16(
+          vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(s4)))));
+      const int16x4_t d = vsub_s16(vld1_s16(master_patch + x), s);
+      acc = vmlal_s16(acc, vmul_s16(d, vld1_s16(weights + x)), d);
+    }
+    master_patch += block_size;
+    weights += block_size;
+  }
+  const int32x2_t sum2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+  return vget_lane_s32(vpadd_s32(sum2, sum2), 0);
+}
+#endif  // XP_HAS_NEON
+
+inline PatchSsdFunc select_patch_ssd(XPDRIVER::SimdIsa isa) {
+  switch (isa) {
+#ifdef XP_HAS_X86_SIMD
+    case XPDRIVER::SimdIsa::AVX2:
+      return patch_ssd_avx2;
+    case XPDRIVER::SimdIsa::SSE4_1:
+      return patch_ssd_sse41;
+#endif
+#ifdef XP_HAS_NEON
+    case XPDRIVER::SimdIsa::NEON:
+      return patch_ssd_neon;
+#endif
+    default:
+      return patch_ssd_scalar;
+  }
+}
+
+// The kernel of the running CPU, selected once
+inline PatchSsdFunc patch_ssd() {
+  static const PatchSsdFunc func = select_patch_ssd(XPDRIVER::detect_simd_isa());
+  return func;
+}
+
+// Scale the float weights so that the max one becomes kMaxPatchWeight
+inline void quantize_patch_weights(const float* weights, int block_size,
+                                   std::vector<int16_t>* weights_q) {
+  CHECK_NOTNULL(weights_q);
+  CHECK_EQ(block_size % 4, 0);
+  CHECK_LE(block_size, kMaxPatchBlockSize);
+  const int count = block_size * block_size;
+  const float max_weight = *std::max_element(weights, weights + count);
+  CHECK_GT(max_weight, 0.f);
+  weights_q->resize(count);
+  for (int i = 0; i < count; ++i) {
+    (*weights_q)[i] = static_cast<int16_t>(std::lround(weights[i] * kMaxPatchWeight / max_weight));
+  }
+}
+
+// Copy the block_size x block_size patch of img with top left corner (x, y) to int16
+inline void load_patch(const cv::Mat& img, int x, int y, int block_size,
+                       std::vector<int16_t>* patch) {
+  CHECK_NOTNULL(patch);
+  patch->resize(block_size * block_size);
+  int16_t* dst = patch->data();
+  for (int r = 0; r < block_size; ++r) {
+    const uint8_t* src = img.ptr<uint8_t>(y + r) + x;
+    for (int c = 0; c < block_size; ++c) {
+      *dst++ = src[c];
+    }
+  }
+}
+
+struct PatchSearchResult {
+  int min_patch_diff2;
+  // Excluding the 2 neighbors of the best position.  INT_MAX if none.
+  int second_min_patch_diff2;
+  float best_x;  // Sub-pixel, by fitting a parabola to the costs around the best position
+  int best_search_id;
+  int second_best_search_id;  // -1 if none
+};
+
+// Search the master patch on row y of slave_img for top left corners x_begin, ..., x_end - 1,
+// i.e., the rectified stereo case without any projection per step.
+// The caller keeps the patches in slave_img.  Return false if the range is empty.
+// costs: scratch to reuse across calls.  The cost of every position on return.
+inline bool search_patch_on_scanline(PatchSsdFunc ssd_func,
+                                     const std::vector<int16_t>& master_patch,
+                                     const std::vector<int16_t>& weights,
+                                     int block_size,
+                                     const cv::Mat& slave_img,
+                                     int y,
+                                     int x_begin,
+                                     int x_end,
+                                     std::vector<int>* costs,
+                                     PatchSearchResult* result) {
+  CHECK_NOTNULL(costs);
+  CHECK_NOTNULL(result);
+  if (x_begin >= x_end) {
+    return false;
+  }
+  const int step = static_cast<int>(slave_img.step[0]);
+  const uint8_t* slave_row = slave_img.ptr<uint8_t>(y);
+  const int num = x_end - x_begin;
+  costs->resize(num);
+  int* cost = costs->data();
+  for (int i = 0; i < num; ++i) {
+    cost[i] = ssd_func(master_patch.data(), weights.data(), slave_row + x_begin + i, step,
+                       block_size);
+  }
+  const int best_id = static_cast<int>(std::min_element(cost, cost + num) - cost);
+  int second_id = -1;
+  int second_min_diff2 = std::numeric_limits<int>::max();
+  for (int i = 0; i < num; ++i) {
+    if (std::abs(i - best_id) > 1 && cost[i] < second_min_diff2) {
+      second_min_diff2 = cost[i];
+      second_id = i;
+    }
+  }
+  result->min_patch_diff2 = cost[best_id];
+  result->second_min_patch_diff2 = second_min_diff2;
+  result->best_search_id = best_id;
+  result->second_best_search_id = second_id;
+  result->best_x = static_cast<float>(x_begin + best_id);
+  if (best_id > 0 && best_id + 1 < num) {
+    const float before = cost[best_id - 1];
+    const float after = cost[best_id + 1];
+    const float denom = 2.f * (before - 2.f * cost[best_id] + after);
+    if (denom > 0.f) {
+      result->best_x += (before - after) / denom;
+    }
+  }
+  return true;
+}
+
+struct ScanlineMatchParams {
+  int block_size;
+  int min_disparity;  // The search range of master x - slave x, in pixel
+  int max_disparity;
+  int max_patch_diff2;  // Reject a best match with a larger cost
+  float uniqueness_ratio;  // Reject a best match unless min < ratio * second min
+  int num_workers;  // Keypoints are split into this many stripes of cv::parallel_for_
+};
+
+namespace internal {
+class ScanlineMatchKeypoints : public cv::ParallelLoopBody {
+ public:
+  ScanlineMatchKeypoints(const cv::Mat& master_img, const cv::Mat& slave_img,
+                         const std::vector<cv::KeyPoint>& master_kps,
+                         const std::vector<int16_t>& weights, const ScanlineMatchParams& params,
+                         std::vector<cv::KeyPoint>* slave_kps, std::vector<uint8_t>* matched) :
+      master_img_(master_img), slave_img_(slave_img), master_kps_(master_kps),
+      weights_(weights), params_(params), slave_kps_(slave_kps), matched_(matched),
+      ssd_func_(patch_ssd()) {}
+
+  void operator()(const cv::Range& range) const override {
+    const int half = params_.block_size / 2;
+    std::vector<int16_t> master_patch;
+    std::vector<int> costs;
+    for (int i = range.start; i < range.end; ++i) {
+      const cv::KeyPoint& kp = master_kps_[i];
+      const int x = static_cast<int>(std::lround(kp.pt.x)) - half;
+      const int y = static_cast<int>(std::lround(kp.pt.y)) - half;
+      if (x < 0 || y < 0 || x + params_.block_size > master_img_.cols ||
+          y + params_.block_size > master_img_.rows) {
+        continue;
+      }
+      load_patch(master_img_, x, y, params_.block_size, &master_patch);
+      const int x_begin = std::max(x - params_.max_disparity, 0);
+      const int x_end = std::min(x - params_.min_disparity + 1,
+                                 slave_img_.cols - params_.block_size + 1);
+      PatchSearchResult result;
+      if (!search_patch_on_scanline(ssd_func_, master_patch, weights_, params_.block_size,
+                                    slave_img_, y, x_begin, x_end, &costs, &result) ||
+          result.min_patch_diff2 > params_.max_patch_diff2 ||
+          result.min_patch_diff2 >= params_.uniqueness_ratio * result.second_min_patch_diff2) {
+        continue;
+      }
+      cv::KeyPoint& slave_kp = (*slave_kps_)[i];
+      slave_kp = kp;
+      slave_kp.pt.x = kp.pt.x + (result.best_x - x);
+      (*matched_)[i] = 1;
+    }
+  }
+
+ private:
+  const cv::Mat& master_img_;
+  const cv::Mat& slave_img_;
+  const std::vector<cv::KeyPoint>& master_kps_;
+  const std::vector<int16_t>& weights_;
+  const ScanlineMatchParams params_;
+  std::vector<cv::KeyPoint>* slave_kps_;
+  std::vector<uint8_t>* matched_;
+  const PatchSsdFunc ssd_func_;
+};
+}  // namespace internal
+
+// Match master_kps on the same rows of slave_img, i.e., rectified stereo images.
+// slave_kps: the matched keypoints, in the order of master_kps, with the class_id (and the
+//            other fields) of their master keypoints.  Return the number of matches.
+inline int match_keypoints_on_scanlines(const cv::Mat& master_img,
+                                        const cv::Mat& slave_img,
+                                        const std::vector<cv::KeyPoint>& master_kps,
+                                        const std::vector<int16_t>& weights,
+                                        const ScanlineMatchParams& params,
+                                        std::vector<cv::KeyPoint>* slave_kps) {
+  CHECK_NOTNULL(slave_kps);
+  CHECK_EQ(master_img.type(), CV_8U);
+  CHECK_EQ(slave_img.type(), CV_8U);
+  CHECK_EQ(weights.size(), static_cast<size_t>(params.block_size * params.block_size));
+  std::vector<cv::KeyPoint> all_slave_kps(master_kps.size());
+  std::vector<uint8_t> matched(master_kps.size(), 0);
+  cv::parallel_for_(cv::Range(0, static_cast<int>(master_kps.size())),
+                    internal::ScanlineMatchKeypoints(master_img, slave_img, master_kps, weights,
+                                                     params, &all_slave_kps, &matched),
+                    std::max(params.num_workers, 1));
+  slave_kps->clear();
+  for (size_t i = 0; i < master_kps.size(); ++i) {
+    if (matched[i]) {
+      slave_kps->push_back(all_slave_kps[i]);
+    }
+  }
+  return static_cast<int>(slave_kps->size());
+}
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_UTIL_PATCH_MATCH_KERNELS_H_
@@ -0,0 +1,207 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_UTIL_PYRAMID_KERNELS_H_
+#define XP_INCLUDE_XP_UTIL_PYRAMID_KERNELS_H_
+
+/*
+ * Row kernels of fast_pyra_down_original and fast_mask_pyra_down (feature_utils.h), i.e.,
+ * 2x2 downsampling of a CV_8U image or mask.  Every variant produces exactly the same output
+ * as the scalar one:
+ * - image: the truncated average of the 4 inputs, (a + b + c + d) >> 2
+ * - mask: 0x00 if any of the 4 inputs is 0x00, otherwise 0xff
+ */
+
+#include <driver/helper/cpu_features.h>
+#include <stdint.h>
+#ifdef XP_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+#ifdef XP_HAS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace XP {
+
+// Downsample the 2 * n pixels of the two input rows src0 and src1 into the n pixels of dst
+typedef void (*PyraDownRowFunc)(const uint8_t* src0, const uint8_t* src1, uint8_t* dst, int n);
+
+inline void pyra_down_row_scalar(const uint8_t* src0, const uint8_t* src1, uint8_t* dst,
+                                 int n) {
+  for (int i = 0; i < n; ++i) {
+    dst[i] = static_cast<uint8_t>((src0[2 * i] + src0[2 * i + 1] +
+                                   src1[2 * i] + src1[2 * i + 1]) >> 2);
+  }
+}
+
+inline void mask_pyra_down_row_scalar(const uint8_t* src0, const uint8_t* src1, uint8_t* dst,
+                                      int n) {
+  for (int i = 0; i < n; ++i) {
+    dst[i] = (src0[2 * i] == 0x00 || src0[2 * i + 1] == 0x00 ||
+              src1[2 * i] == 0x00 || src1[2 * i + 1] == 0x00) ? 0x00 : 0xff;
+  }
+}
+
+#ifdef XP_HAS_X86_SIMD
+XP_TARGET_SSE41
+inline void pyra_down_row_sse41(const uint8_t* src0, const uint8_t* src1, uint8_t* dst,
+                                int n) {
+  // maddubs with 1s sums the adjacent pixels into 16 bits
+  const __m128i ones = _mm_set1_epi8(1);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 2 * i));
+    const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 2 * i + 16));
+    const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 2 * i));
+    const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 2 * i + 16));
+    const __m128i sum0 = _mm_add_epi16(_mm_maddubs_epi16(a0, ones), _mm_maddubs_epi16(b0, ones));
+    const __m128i sum1 = _mm_add_epi16(_mm_maddubs_epi16(a1, ones), _mm_maddubs_epi16(b1, ones));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     _mm_packus_epi16(_mm_srli_epi16(sum0, 2), _mm_srli_epi16(sum1, 2)));
+  }
+  pyra_down_row_scalar(src0 + 2 * i, src1 + 2 * i, dst + i, n - i);
+}
+
+XP_TARGET_SSE41
+inline void mask_pyra_down_row_sse41(const uint8_t* src0, const uint8_t* src1, uint8_t* dst,
+                                     int n) {
+  const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i all_ones = _mm_set1_epi8(-1);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // The vertical min, then the min of the adjacent pixels in 16 bits
+    const __m128i m0 = _mm_min_epu8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 2 * i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 2 * i)));
+    const __m128i m1 = _mm_min_epu8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 2 * i + 16)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 2 * i + 16)));
+    const __m128i h0 = _mm_min_epi16(_mm_and_si128(m0, low_bytes), _mm_srli_epi16(m0, 8));
+    const __m128i h1 = _mm_min_epi16(_mm_and_si128(m1, low_bytes), _mm_srli_epi16(m1, 8));
+    const __m128i is_zero = _mm_cmpeq_epi8(_mm_packus_epi16(h0, h1), zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(is_zero, all_ones));
+  }
+  mask_pyra_down_row_scalar(src0 + 2 * i, src1 + 2 * i, dst + i, n - i);
+}
+
+XP_TARGET_AVX2
+inline void pyra_down_row_avx2(const uint8_t* src0, const uint8_t* src1, uint8_t* dst, int n) {
+  const __m256i ones = _mm256_set1_epi8(1);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + 2 * i));
+    const __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + 2 * i + 32));
+    const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + 2 * i));
+    const __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + 2 * i + 32));
+    const __m256i sum0 = _mm256_add_epi16(_mm256_maddubs_epi16(a0, ones),
+                                          _mm256_maddubs_epi16(b0, ones));
+    const __m256i sum1 = _mm256_add_epi16(_mm256_maddubs_epi16(a1, ones),
+                                          _mm256_maddubs_epi16(b1, ones));
+    // packus works per lane: [0-7, 16-23 | 8-15, 24-31] -> reorder the 64-bit blocks
+    const __m256i out = _mm256_packus_epi16(_mm256_srli_epi16(sum0, 2),
+                                            _mm256_srli_epi16(sum1, 2));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                        _mm256_permute4x64_epi64(out, _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+  pyra_down_row_sse41(src0 + 2 * i, src1 + 2 * i, dst + i, n - i);
+}
+
+XP_TARGET_AVX2
+inline void mask_pyra_down_row_avx2(const uint8_t* src0, const uint8_t* src1, uint8_t* dst,
+                                    int n) {
+  const __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i all_ones = _mm256_set1_epi8(-1);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i m0 = _mm256_min_epu8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + 2 * i)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + 2 * i)));
+    const __m256i m1 = _mm256_min_epu8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + 2 * i + 32)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + 2 * i + 32)));
+    const __m256i h0 = _mm256_min_epi16(_mm256_and_si256(m0, low_bytes),
+                                        _mm256_srli_epi16(m0, 8));
+    const __m256i h1 = _mm256_min_epi16(_mm256_and_si256(m1, low_bytes),
+                                        _mm256_srli_epi16(m1, 8));
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(h0, h1),
+                                                    _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                        _mm256_xor_si256(_mm256_cmpeq_epi8(packed, zero), all_ones));
+  }
+  mask_pyra_down_row_sse41(src0 + 2 * i, src1 + 2 * i, dst + i, n - i);
+}
+#endif  // XP_HAS_X86_SIMD
+
+#ifdef XP_HAS_NEON
+inline void pyra_down_row_neon(const uint8_t* src0, const uint8_t* src1, uint8_t* dst, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // Pairwise sums of the adjacent pixels in 16 bits, accumulated over the 2 rows
+    uint16x8_t sum0 = vpaddlq_u8(vld1q_u8(src0 + 2 * i));
+    uint16x8_t sum1 = vpaddlq_u8(vld1q_u8(src0 + 2 * i + 16));
+    sum0 = vpadalq_u8(sum0, vld1q_u8(src1 + 2 * i));
+    sum1 = vpadalq_u8(sum1, vld1q_u8(src1 + 2 * i + 16));
+    vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(sum0, 2), vshrn_n_u16(sum1, 2)));
+  }
+  pyra_down_row_scalar(src0 + 2 * i, src1 + 2 * i, dst + i, n - i);
+}
+
+inline void mask_pyra_down_row_neon(const uint8_t* src0, const uint8_t* src1, uint8_t* dst,
+                                    int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // val[0] / val[1]: the even / odd pixels
+    const uint8x16x2_t a = vld2q_u8(src0 + 2 * i);
+    const uint8x16x2_t b = vld2q_u8(src1 + 2 * i);
+    const uint8x16_t m = vminq_u8(vminq_u8(a.val[0], a.val[1]), vminq_u8(b.val[0], b.val[1]));
+    // 0xff where m is not 0
+    vst1q_u8(dst + i, vtstq_u8(m, m));
+  }
+  mask_pyra_down_row_scalar(src0 + 2 * i, src1 + 2 * i, dst + i, n - i);
+}
+#endif  // XP_HAS_NEON
+
+struct PyraDownKernels {
+  PyraDownRowFunc pyra_down_row;
+  PyraDownRowFunc mask_pyra_down_row;
+};
+
+inline PyraDownKernels select_pyra_down_kernels(XPDRIVER::SimdIsa isa) {
+  switch (isa) {
+#ifdef XP_HAS_X86_SIMD
+    case XPDRIVER::SimdIsa::AVX2:
+      return {pyra_down_row_avx2, mask_pyra_down_row_avx2};
+    case XPDRIVER::SimdIsa::SSE4_1:
+      return {pyra_down_row_sse41, mask_pyra_down_row_sse41};
+#endif
+#ifdef XP_HAS_NEON
+    case XPDRIVER::SimdIsa::NEON:
+      return {pyra_down_row_neon, mask_pyra_down_row_neon};
+#endif
+    default:
+      return {pyra_down_row_scalar, mask_pyra_down_row_scalar};
+  }
+}
+
+// The kernels of the running CPU, selected once
+inline const PyraDownKernels& pyra_down_kernels() {
+  static const PyraDownKernels kernels = select_pyra_down_kernels(XPDRIVER::detect_simd_isa());
+  return kernels;
+}
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_UTIL_PYRAMID_KERNELS_H_
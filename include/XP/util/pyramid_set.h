@@ -0,0 +1,234 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef XP_INCLUDE_XP_UTIL_PYRAMID_SET_H_
+#define XP_INCLUDE_XP_UTIL_PYRAMID_SET_H_
+
+/*
+ * The image and mask pyramids of one stereo frame, built once and shared read-only by every
+ * module working on the frame: feature tracking (FeatureTrackDetector::set_img_pyramids
+ * copies the left levels), detection (detect_orb_features), and the mapper, which gets the
+ * std::shared_ptr with the keyframe and propagates features from it
+ * (ImgFeaturePropagator::PropagateFeatures).
+ * The image levels of a set live in one arena that PyramidSetPool recycles once the last
+ * std::shared_ptr to the set is released, so a warmed-up pool does not allocate the arenas
+ * again.  Each build() still allocates the small control block of the std::shared_ptr.
+ * The camera masks do not change, so the pool builds their pyramids once for all the sets.
+ */
+
+#include <XP/util/pyramid_kernels.h>
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace XP {
+
+// Downsample src into the preallocated dst of size (src.rows / 2, src.cols / 2)
+inline void pyra_down_to(PyraDownRowFunc row_func, const cv::Mat& src, cv::Mat* dst) {
+  CHECK_NOTNULL(dst);
+  CHECK_EQ(src.type(), CV_8U);
+  CHECK_EQ(dst->type(), CV_8U);
+  CHECK_EQ(dst->rows, src.rows / 2);
+  CHECK_EQ(dst->cols, src.cols / 2);
+  for (int y = 0; y < dst->rows; ++y) {
+    row_func(src.ptr<uchar>(2 * y), src.ptr<uchar>(2 * y + 1), dst->ptr<uchar>(y), dst->cols);
+  }
+}
+
+class PyramidSet {
+ public:
+  enum {
+    LEFT = 0,
+    RIGHT = 1
+  };
+  PyramidSet& operator=(const PyramidSet&) = delete;
+  PyramidSet(const PyramidSet& other) = delete;
+
+  // Total pyramid levels, including the base image
+  int levels() const { return levels_; }
+  // A mono set has no RIGHT pyramids
+  bool has_img(int lr) const { return !img_pyramids_[lr].empty(); }
+  // Level 0 is the 3x3 box-smoothed input image, i.e., the img_in_smooth of feature_utils.h
+  const std::vector<cv::Mat>& img_pyramids(int lr) const { return img_pyramids_[lr]; }
+  // The camera mask pyramids of PyramidSetPool::set_masks, or all 0xff
+  const std::vector<cv::Mat_<uchar>>& mask_pyramids(int lr) const { return mask_pyramids_[lr]; }
+  // All the levels of img_pyramids(lr), one after another without padding
+  const uchar* img_buffer(int lr) const { return arena_.get() + lr * side_bytes_; }
+
+ private:
+  friend class PyramidSetPool;
+  PyramidSet(const cv::Size& img_size, int levels) : levels_(levels) {
+    side_bytes_ = 0;
+    for (int l = 0; l < levels; ++l) {
+      side_bytes_ += static_cast<size_t>(img_size.height >> l) * (img_size.width >> l);
+    }
+    arena_.reset(new uchar[2 * side_bytes_]);
+    for (int lr = 0; lr < 2; ++lr) {
+      uchar* level_ptr = arena_.get() + lr * side_bytes_;
+      cv::Size level_size = img_size;
+      for (int l = 0; l < levels; ++l) {
+        arena_levels_[lr].push_back(cv::Mat(level_size, CV_8U, level_ptr));
+        level_ptr += level_size.area();
+        level_size = cv::Size(level_size.width / 2, level_size.height / 2);
+      }
+    }
+  }
+
+  const int levels_;
+  size_t side_bytes_;
+  std::unique_ptr<uchar[]> arena_;
+  std::vector<cv::Mat> arena_levels_[2];  // Headers of the arena, set once
+  std::vector<cv::Mat> img_pyramids_[2];  // arena_levels_[lr], or empty if there is no image
+  std::vector<cv::Mat_<uchar>> mask_pyramids_[2];
+};
+
+class PyramidSetPool {
+ public:
+  PyramidSetPool& operator=(const PyramidSetPool&) = delete;
+  PyramidSetPool(const PyramidSetPool& other) = delete;
+
+  // levels: total pyramid levels, including the base image.  Use the max of all the users,
+  //         e.g., FeatureTrackDetector::kMaxPyraLevelOF and the detection level + 1.
+  // max_free_sets: the unused sets kept for reuse.  Sets held by keyframes are not counted.
+  PyramidSetPool(const cv::Size& img_size, int levels, size_t max_free_sets = 4) :
+      img_size_(img_size),
+      levels_(levels),
+      shared_(std::make_shared<Shared>(max_free_sets)) {
+    CHECK_GT(levels, 0);
+    CHECK_GE(img_size.height >> (levels - 1), 1);
+    CHECK_GE(img_size.width >> (levels - 1), 1);
+    set_masks(cv::Mat_<uchar>(), cv::Mat_<uchar>());
+  }
+
+  // Build the mask pyramids shared by the sets built from now on.  An empty mask means all 0xff.
+  // Sets already built keep the previous masks.
+  void set_masks(const cv::Mat_<uchar>& mask_l, const cv::Mat_<uchar>& mask_r) {
+    const cv::Mat_<uchar>* masks[2] = {&mask_l, &mask_r};
+    std::vector<cv::Mat_<uchar>> mask_pyramids[2];
+    for (int lr = 0; lr < 2; ++lr) {
+      cv::Mat_<uchar> mask;
+      if (masks[lr]->empty()) {
+        mask = cv::Mat_<uchar>(img_size_, 0xff);
+      } else {
+        CHECK_EQ(masks[lr]->size(), img_size_);
+        mask = masks[lr]->clone();
+      }
+      mask_pyramids[lr].push_back(mask);
+      for (int l = 1; l < levels_; ++l) {
+        const cv::Mat& prev = mask_pyramids[lr].back();
+        cv::Mat_<uchar> mask_small(prev.rows / 2, prev.cols / 2);
+        cv::Mat mask_small_mat = mask_small;
+        pyra_down_to(pyra_down_kernels().mask_pyra_down_row, prev, &mask_small_mat);
+        mask_pyramids[lr].push_back(mask_small);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mask_mutex_);
+    mask_pyramids_[0].swap(mask_pyramids[0]);
+    mask_pyramids_[1].swap(mask_pyramids[1]);
+  }
+
+  // Smooth img_l (and img_r) and build their pyramids into a free set.  Leave img_r empty for a
+  // mono set.  Thread-safe, and the returned set can be released by any thread.
+  std::shared_ptr<const PyramidSet> build(const cv::Mat& img_l, const cv::Mat& img_r) {
+    std::unique_ptr<PyramidSet> set = shared_->take_set();
+    if (!set) {
+      set.reset(new PyramidSet(img_size_, levels_));
+    }
+    const cv::Mat* imgs[2] = {&img_l, &img_r};
+    for (int lr = 0; lr < 2; ++lr) {
+      set->img_pyramids_[lr].clear();
+      if (imgs[lr]->empty()) {
+        CHECK_EQ(lr, PyramidSet::RIGHT) << "The left image is required";
+        continue;
+      }
+      CHECK_EQ(imgs[lr]->type(), CV_8U);
+      CHECK_EQ(imgs[lr]->size(), img_size_);
+      std::vector<cv::Mat>& levels = set->arena_levels_[lr];
+      // Same smoothing as the raw-image overload of detect_orb_features.  The level 0 header
+      // has the right size and type, so blur writes into the arena.
+      cv::blur(*imgs[lr], levels[0], cv::Size(3, 3));
+      CHECK_EQ(levels[0].data, set->img_buffer(lr));
+      for (int l = 1; l < levels_; ++l) {
+        pyra_down_to(pyra_down_kernels().pyra_down_row, levels[l - 1], &levels[l]);
+      }
+      set->img_pyramids_[lr] = levels;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mask_mutex_);
+      set->mask_pyramids_[0] = mask_pyramids_[0];
+      set->mask_pyramids_[1] = mask_pyramids_[1];
+    }
+    // The deleter owns a reference to shared_, so that sets can outlive the pool.
+    // [NOTE] This allocates the control block (and the deleter) on every build.
+    std::shared_ptr<Shared> shared = shared_;
+    return std::shared_ptr<const PyramidSet>(set.release(), [shared](const PyramidSet* set) {
+      shared->give_back_set(const_cast<PyramidSet*>(set));
+    });
+  }
+
+  // The sets ever allocated, i.e., the arenas in use + the free ones
+  size_t allocated_sets() const { return shared_->allocated_sets(); }
+
+ private:
+  class Shared {
+   public:
+    explicit Shared(size_t max_free_sets) : max_free_sets_(max_free_sets), allocated_sets_(0) {}
+
+    // Return nullptr if there is no free set
+    std::unique_ptr<PyramidSet> take_set() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_sets_.empty()) {
+        ++allocated_sets_;
+        return nullptr;
+      }
+      std::unique_ptr<PyramidSet> set = std::move(free_sets_.back());
+      free_sets_.pop_back();
+      return set;
+    }
+
+    void give_back_set(PyramidSet* set) {
+      std::unique_ptr<PyramidSet> set_ptr(set);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_sets_.size() < max_free_sets_) {
+        free_sets_.push_back(std::move(set_ptr));
+      } else {
+        --allocated_sets_;
+      }
+    }
+
+    size_t allocated_sets() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return allocated_sets_;
+    }
+
+   private:
+    const size_t max_free_sets_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<PyramidSet>> free_sets_;
+    size_t allocated_sets_;
+  };
+
+  const cv::Size img_size_;
+  const int levels_;
+  std::shared_ptr<Shared> shared_;
+  std::mutex mask_mutex_;
+  std::vector<cv::Mat_<uchar>> mask_pyramids_[2];
+};
+
+}  // namespace XP
+#endif  // XP_INCLUDE_XP_UTIL_PYRAMID_SET_H_
@@ -0,0 +1,68 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef INCLUDE_DRIVER_HELPER_CPU_FEATURES_H_
+#define INCLUDE_DRIVER_HELPER_CPU_FEATURES_H_
+
+/*
+ * Runtime detection of the SIMD instruction set of the host CPU.
+ * x86 kernels are compiled with function-level target attributes, so the binary still runs
+ * on CPUs without SSE4.1 / AVX2 as long as the kernel is picked with detect_simd_isa().
+ */
+
+#include <string>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define XP_HAS_X86_SIMD
+#define XP_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define XP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define XP_HAS_NEON
+#endif
+
+namespace XPDRIVER {
+
+enum class SimdIsa {
+  SCALAR = 0,
+  SSE4_1 = 1,
+  AVX2 = 2,
+  NEON = 3
+};
+
+const std::string SimdIsaName[] = {"scalar", "SSE4.1", "AVX2", "NEON"};
+
+// Returns the best instruction set supported by the running CPU.
+// The result does not change during the lifetime of the process, so call it once
+// (e.g. in init()) and keep the selected kernels.
+inline SimdIsa detect_simd_isa() {
+#if defined(XP_HAS_NEON)
+  return SimdIsa::NEON;
+#elif defined(XP_HAS_X86_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdIsa::AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return SimdIsa::SSE4_1;
+  }
+  return SimdIsa::SCALAR;
+#else
+  return SimdIsa::SCALAR;
+#endif
+}
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_CPU_FEATURES_H_
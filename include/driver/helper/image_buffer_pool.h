@@ -0,0 +1,167 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef INCLUDE_DRIVER_HELPER_IMAGE_BUFFER_POOL_H_
+#define INCLUDE_DRIVER_HELPER_IMAGE_BUFFER_POOL_H_
+
+/*
+ * A size-keyed pool of image buffers exposed as a cv::MatAllocator.
+ * A cv::Mat whose allocator is set to the pool takes its buffer from the pool, and gives it
+ * back when the last cv::Mat header referring to it is released (cv::Mat keeps the refcount).
+ * Once the pool is warmed up, creating per-frame images of the same sizes does not touch
+ * the heap.
+ */
+
+#include <driver/helper/xp_logging.h>
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+namespace XPDRIVER {
+
+class ImageBufferPool : public cv::MatAllocator {
+ public:
+  // The process-wide pool shared by the driver and the apps.
+  // [NOTE] The instance is never destructed, so that global cv::Mat objects released after
+  //        main returns can still give their buffers back.
+  static ImageBufferPool& getInstance() {
+    static ImageBufferPool* instance = new ImageBufferPool();
+    return *instance;
+  }
+
+  // Keep at most max_free_blocks_per_size unused buffers of each size
+  explicit ImageBufferPool(size_t max_free_blocks_per_size = 16) :
+      max_free_blocks_per_size_(max_free_blocks_per_size), hit_count_(0), miss_count_(0) {}
+  ~ImageBufferPool() {
+    for (auto& size_and_blocks : free_blocks_) {
+      for (uint8_t* block : size_and_blocks.second) {
+        cv::fastFree(block);
+      }
+    }
+  }
+
+  // Set pool as the allocator of *mat and (re)allocate it if needed
+  void create(int rows, int cols, int type, cv::Mat* mat) {
+    XP_CHECK_NOTNULL(mat);
+    if (mat->allocator != this) {
+      mat->release();
+      mat->allocator = this;
+    }
+    mat->create(rows, cols, type);
+  }
+  // The pooled version of cv::Mat::clone()
+  void copy(const cv::Mat& src, cv::Mat* dst) {
+    XP_CHECK_NOTNULL(dst);
+    create(src.rows, src.cols, src.type(), dst);
+    src.copyTo(*dst);
+  }
+
+  uint64_t hit_count() const { return hit_count_; }
+  uint64_t miss_count() const { return miss_count_; }
+
+  // cv::MatAllocator interface
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step,
+                         int /*flags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; --i) {
+      if (step) {
+        if (data0 && step[i] != CV_AUTOSTEP) {
+          XP_CHECK_GE(step[i], total);
+          total = step[i];
+        } else {
+          step[i] = total;
+        }
+      }
+      total *= sizes[i];
+    }
+    if (data0) {
+      // The user owns the data.  Nothing to pool.
+      cv::UMatData* u = new cv::UMatData(this);
+      u->data = u->origdata = static_cast<uchar*>(data0);
+      u->size = total;
+      u->flags |= cv::UMatData::USER_ALLOCATED;
+      return u;
+    }
+    uint8_t* block = take_block(total);
+    cv::UMatData* u = new (block) cv::UMatData(this);
+    u->data = u->origdata = block + kHeaderSize;
+    u->size = total;
+    return u;
+  }
+
+  bool allocate(cv::UMatData* u, int /*accessflags*/,
+                cv::UMatUsageFlags /*usageFlags*/) const override {
+    return u != nullptr;
+  }
+
+  void deallocate(cv::UMatData* u) const override {
+    if (u == nullptr) {
+      return;
+    }
+    XP_CHECK_EQ(u->refcount, 0);
+    XP_CHECK_EQ(u->urefcount, 0);
+    if (u->flags & cv::UMatData::USER_ALLOCATED) {
+      delete u;
+      return;
+    }
+    const size_t size = u->size;
+    u->~UMatData();
+    give_back_block(reinterpret_cast<uint8_t*>(u), size);
+  }
+
+ private:
+  // Each block holds the cv::UMatData header followed by the pixels.  The header size is
+  // padded to 64 bytes to keep the pixels as aligned as the cv::fastMalloc result.
+  static constexpr size_t kHeaderSize = (sizeof(cv::UMatData) + 63) / 64 * 64;
+
+  uint8_t* take_block(size_t size) const {
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      auto it = free_blocks_.find(size);
+      if (it != free_blocks_.end() && !it->second.empty()) {
+        uint8_t* block = it->second.back();
+        it->second.pop_back();
+        ++hit_count_;
+        return block;
+      }
+    }
+    ++miss_count_;
+    return static_cast<uint8_t*>(cv::fastMalloc(kHeaderSize + size));
+  }
+
+  void give_back_block(uint8_t* block, size_t size) const {
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      std::vector<uint8_t*>& blocks = free_blocks_[size];
+      if (blocks.size() < max_free_blocks_per_size_) {
+        blocks.push_back(block);
+        return;
+      }
+    }
+    cv::fastFree(block);
+  }
+
+  const size_t max_free_blocks_per_size_;
+  mutable std::mutex m_;
+  mutable std::unordered_map<size_t, std::vector<uint8_t*>> free_blocks_;
+  mutable std::atomic<uint64_t> hit_count_;
+  mutable std::atomic<uint64_t> miss_count_;
+};
+
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_IMAGE_BUFFER_POOL_H_
@@ -0,0 +1,226 @@
+/******************************************************************************
+ * Copyright 2017-2018 Baidu Robotic Vision Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+#ifndef INCLUDE_DRIVER_HELPER_SPSC_QUEUE_H_
+#define INCLUDE_DRIVER_HELPER_SPSC_QUEUE_H_
+
+/*
+ * A bounded lock-free single-producer / single-consumer queue.
+ * It follows the interface of shared_queue (wait_and_pop_front, wait_and_pop_to_back, kill),
+ * so a queue with exactly one pushing thread and one popping thread can switch over by only
+ * changing its type.
+ * The producer never takes a lock.  The consumer only enters the kernel (futex) when the
+ * queue is empty, and the producer only issues a wake-up when the consumer is sleeping.
+ */
+
+#include <driver/helper/xp_logging.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif  // __linux__
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace XPDRIVER {
+
+template <typename T>
+class spsc_queue {
+ public:
+  // Remove copy and assign
+  spsc_queue& operator=(const spsc_queue&) = delete;
+  spsc_queue(const spsc_queue& other) = delete;
+
+  // capacity is rounded up to a power of 2
+  explicit spsc_queue(const std::string& name, size_t capacity = 64) :
+      name_(name), kill_(false), head_(0), tail_(0), seq_(0), consumer_waiting_(false),
+      head_cache_(0), tail_cache_(0) {
+    capacity_ = 2;
+    while (capacity_ < capacity) {
+      capacity_ <<= 1;
+    }
+    mask_ = capacity_ - 1;
+    buf_.reset(new T[capacity_]);
+  }
+  ~spsc_queue() {
+    // make sure you always call kill before destruction
+    if (!kill_ && !empty()) {
+      XP_LOG_ERROR("spsc_queue " << name_ << " is destructed without getting killed");
+    }
+  }
+
+  // Use this function to kill the spsc_queue before the application exists
+  // to prevent potential deadlock.
+  void kill() {
+    kill_ = true;
+    seq_.fetch_add(1);
+    wake_consumer();
+  }
+
+  // Use this function to "re-initialize" the spsc_queue.
+  // Only call it when neither the producer nor the consumer is running.
+  void reinit() {
+    if (kill_) {
+      kill_ = false;
+      this->clear();
+    }
+  }
+
+  // [Producer only] Return false (and drop elem) if the queue is full
+  bool push_back(T elem) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ >= capacity_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ >= capacity_) {
+        return false;
+      }
+    }
+    buf_[tail & mask_] = std::move(elem);
+    tail_.store(tail + 1, std::memory_order_release);
+    // Pairs with the fence in wait_until_not_empty
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting_.load(std::memory_order_relaxed)) {
+      seq_.fetch_add(1);
+      wake_consumer();
+    }
+    return true;
+  }
+
+  // [Consumer only]
+  bool try_pop_front(T* elem) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) {
+        return false;
+      }
+    }
+    *elem = std::move(buf_[head & mask_]);
+    buf_[head & mask_] = T();  // Release whatever the slot holds
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // [Consumer only]
+  bool wait_and_pop_front(T* elem) {
+    if (!wait_until_not_empty()) {
+      return false;
+    }
+    return try_pop_front(elem);
+  }
+
+  // [Consumer only] Get the last element and drop all the others
+  bool wait_and_pop_to_back(T* elem) {
+    if (!wait_until_not_empty()) {
+      return false;
+    }
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    size_t head = head_.load(std::memory_order_relaxed);
+    for (; head + 1 < tail; ++head) {
+      buf_[head & mask_] = T();
+    }
+    *elem = std::move(buf_[head & mask_]);
+    buf_[head & mask_] = T();
+    tail_cache_ = tail;
+    head_.store(tail, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+
+  size_t size() const {
+    const size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // [Consumer only]
+  void clear() {
+    T elem;
+    while (try_pop_front(&elem)) {}
+  }
+
+ private:
+  static constexpr size_t kCacheLineSize = 64;
+
+  // Return false if the queue is killed
+  bool wait_until_not_empty() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    while (!kill_) {
+      if (head != tail_.load(std::memory_order_acquire)) {
+        return true;
+      }
+      const uint32_t seq = seq_.load(std::memory_order_acquire);
+      consumer_waiting_.store(true, std::memory_order_relaxed);
+      // Pairs with the fence in push_back: either the producer sees consumer_waiting_,
+      // or we see the new tail_ here.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!kill_ && head == tail_.load(std::memory_order_relaxed)) {
+        sleep_while_seq_is(seq);
+      }
+      consumer_waiting_.store(false, std::memory_order_relaxed);
+    }
+    return false;
+  }
+
+#ifdef __linux__
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int), "futex requires 32-bit words");
+  void sleep_while_seq_is(uint32_t seq) {
+    syscall(SYS_futex, reinterpret_cast<int*>(&seq_), FUTEX_WAIT_PRIVATE,
+            static_cast<int>(seq), nullptr, nullptr, 0);
+  }
+  void wake_consumer() {
+    syscall(SYS_futex, reinterpret_cast<int*>(&seq_), FUTEX_WAKE_PRIVATE,
+            INT_MAX, nullptr, nullptr, 0);
+  }
+#else
+  // A lost wake-up only delays the consumer by 1 ms on platforms without futex
+  void sleep_while_seq_is(uint32_t seq) {
+    std::unique_lock<std::mutex> lock(m_);
+    cond_.wait_for(lock, std::chrono::milliseconds(1), [this, seq]() { return seq_ != seq; });
+  }
+  void wake_consumer() {
+    std::lock_guard<std::mutex> lock(m_);
+    cond_.notify_all();
+  }
+  std::mutex m_;
+  std::condition_variable cond_;
+#endif  // __linux__
+
+  std::string name_;
+  std::unique_ptr<T[]> buf_;
+  size_t capacity_;
+  size_t mask_;
+  std::atomic<bool> kill_;
+  // The consumer owns head_, the producer owns tail_.  Keep them on separate cache lines.
+  alignas(kCacheLineSize) std::atomic<size_t> head_;
+  alignas(kCacheLineSize) std::atomic<size_t> tail_;
+  alignas(kCacheLineSize) std::atomic<uint32_t> seq_;
+  std::atomic<bool> consumer_waiting_;
+  // Local copies to avoid touching the other side's cache line on every call
+  alignas(kCacheLineSize) size_t head_cache_;  // used by the producer
+  alignas(kCacheLineSize) size_t tail_cache_;  // used by the consumer
+};
+}  // namespace XPDRIVER
+#endif  // INCLUDE_DRIVER_HELPER_SPSC_QUEUE_H_